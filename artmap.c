@@ -0,0 +1,857 @@
+/* artmap.c - implements adaptive radix tree-based map data structure */
+#include "artmap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* node types; a node shrinks to the next smaller type once its children fit
+   with some room to spare, so that a key alternately inserted and removed at
+   a boundary does not resize the node every time */
+#define ART_NODE4 0
+#define ART_NODE16 1
+#define ART_NODE48 2
+#define ART_NODE256 3
+#define ART_SHRINK16 3
+#define ART_SHRINK48 12
+#define ART_SHRINK256 37
+#define ART_NODE_ALIGN 64
+
+/* at most this many bytes of a compressed path are stored in a node; a longer
+   path is skipped during a search (the key that is found is compared in full
+   anyway) and its remaining bytes are read from a key below the node when the
+   path has to be split */
+#define ART_PREFIX_MAX 8
+
+/* a child slot holds either a leaf or an inner node; a leaf is a small block that
+   refers to the key object (which may have any address, such as a pointer into
+   a string) and, like an inner node, comes from the allocator and so has the low
+   bit of its address clear; that bit is set in a slot to mark an inner node; a
+   key that ends at a node is stored in the node's 'leaf' member directly */
+#define ART_IS_NODE(p) (((uintptr_t)(p) & 1) != 0)
+#define ART_NODE(p) ((struct art_node*)((uintptr_t)(p) & ~(uintptr_t)1))
+#define ART_TAG(n) ((void*)((uintptr_t)(n) | 1))
+
+/* structures used by the implementation; every node type begins with the
+   header 'struct art_node'; Node4 and Node16 keep their key bytes sorted;
+   Node48 maps a byte to a child slot plus one (zero for none) */
+struct art_leaf
+{
+    void* key;
+};
+struct art_node
+{
+    uint8_t type;
+    uint16_t count; /* number of children */
+    uint32_t prefixlen;
+    uint8_t prefix[ART_PREFIX_MAX];
+    void* leaf; /* key that ends at this node or NULL */
+};
+struct art_node4
+{
+    struct art_node n;
+    uint8_t keys[4];
+    void* children[4];
+};
+struct art_node16
+{
+    struct art_node n;
+    uint8_t keys[16];
+    void* children[16];
+};
+struct art_node48
+{
+    struct art_node n;
+    uint8_t index[256];
+    void* children[48];
+};
+struct art_node256
+{
+    struct art_node n;
+    void* children[256];
+};
+
+/* key functions */
+const void* art_key_string(const char* key,size_t* len)
+{
+    *len = strlen(key);
+    return key;
+}
+const void* art_key_pstring(const char** key,size_t* len)
+{
+    *len = strlen(*key);
+    return *key;
+}
+
+/* art_leaf */
+static struct art_leaf* art_leaf_new(void* key)
+{
+    struct art_leaf* leaf;
+    leaf = malloc(sizeof(struct art_leaf));
+    if (leaf != NULL)
+        leaf->key = key;
+    return leaf;
+}
+
+/* art_node */
+static struct art_node* art_node_new(int type)
+{
+    static const size_t sizes[] = {
+        sizeof(struct art_node4), sizeof(struct art_node16),
+        sizeof(struct art_node48), sizeof(struct art_node256)
+    };
+    size_t size;
+    struct art_node* node;
+    size = (sizes[type] + ART_NODE_ALIGN-1) & ~(size_t)(ART_NODE_ALIGN-1);
+    node = aligned_alloc(ART_NODE_ALIGN,size);
+    if (node == NULL)
+        return NULL;
+    memset(node,0,size);
+    node->type = type;
+    return node;
+}
+static void art_node_delete(void* p,destructor dstor)
+{
+    int i;
+    struct art_node* node;
+    if (!ART_IS_NODE(p)) {
+        if (dstor != NULL)
+            (*dstor)(((struct art_leaf*)p)->key);
+        free(p);
+        return;
+    }
+    node = ART_NODE(p);
+    if (node->leaf != NULL && dstor != NULL)
+        (*dstor)(node->leaf);
+    switch (node->type) {
+    case ART_NODE4:
+        for (i = 0;i < node->count;++i)
+            art_node_delete(((struct art_node4*)node)->children[i],dstor);
+        break;
+    case ART_NODE16:
+        for (i = 0;i < node->count;++i)
+            art_node_delete(((struct art_node16*)node)->children[i],dstor);
+        break;
+    case ART_NODE48:
+        for (i = 0;i < 48;++i)
+            if (((struct art_node48*)node)->children[i] != NULL)
+                art_node_delete(((struct art_node48*)node)->children[i],dstor);
+        break;
+    case ART_NODE256:
+        for (i = 0;i < 256;++i)
+            if (((struct art_node256*)node)->children[i] != NULL)
+                art_node_delete(((struct art_node256*)node)->children[i],dstor);
+        break;
+    }
+    free(node);
+}
+static void** art_node_find(struct art_node* node,uint8_t c)
+{
+    /* return the slot of the child for byte 'c' or NULL if there is none */
+    int i;
+    switch (node->type) {
+    case ART_NODE4: {
+        struct art_node4* n4 = (struct art_node4*)node;
+        for (i = 0;i < node->count;++i)
+            if (n4->keys[i] == c)
+                return n4->children + i;
+        break;
+    }
+    case ART_NODE16: {
+        struct art_node16* n16 = (struct art_node16*)node;
+#if defined(__SSE2__)
+        unsigned int m;
+        __m128i keys = _mm_loadu_si128((const __m128i*)n16->keys);
+        m = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(keys,_mm_set1_epi8((char)c)));
+        m &= (1u << node->count) - 1;
+        if (m != 0)
+            return n16->children + __builtin_ctz(m);
+#else
+        for (i = 0;i < node->count;++i)
+            if (n16->keys[i] == c)
+                return n16->children + i;
+#endif
+        break;
+    }
+    case ART_NODE48: {
+        struct art_node48* n48 = (struct art_node48*)node;
+        if (n48->index[c] != 0)
+            return n48->children + n48->index[c] - 1;
+        break;
+    }
+    case ART_NODE256: {
+        struct art_node256* n256 = (struct art_node256*)node;
+        if (n256->children[c] != NULL)
+            return n256->children + c;
+        break;
+    }
+    }
+    return NULL;
+}
+static void* art_node_first(struct art_node* node)
+{
+    /* return the least child of 'node' (ignoring 'leaf') */
+    int i;
+    switch (node->type) {
+    case ART_NODE4:
+        return ((struct art_node4*)node)->children[0];
+    case ART_NODE16:
+        return ((struct art_node16*)node)->children[0];
+    case ART_NODE48:
+        for (i = 0;((struct art_node48*)node)->index[i] == 0;++i)
+            ;
+        return ((struct art_node48*)node)->children[((struct art_node48*)node)->index[i] - 1];
+    }
+    for (i = 0;((struct art_node256*)node)->children[i] == NULL;++i)
+        ;
+    return ((struct art_node256*)node)->children[i];
+}
+static void* art_node_min_leaf(struct art_node* node)
+{
+    /* return a key below 'node'; all of them share the node's compressed path */
+    void* p;
+    while (node->leaf == NULL) {
+        p = art_node_first(node);
+        if (!ART_IS_NODE(p))
+            return ((struct art_leaf*)p)->key;
+        node = ART_NODE(p);
+    }
+    return node->leaf;
+}
+static void art_node_copy_header(struct art_node* dst,struct art_node* src)
+{
+    dst->count = src->count;
+    dst->prefixlen = src->prefixlen;
+    memcpy(dst->prefix,src->prefix,ART_PREFIX_MAX);
+    dst->leaf = src->leaf;
+}
+static struct art_node* art_node_grow(struct art_node* node)
+{
+    /* replace the full node 'node' with a copy of the next larger type; return
+       NULL (keeping 'node') if there is no memory for it */
+    int i;
+    struct art_node* newnode;
+    newnode = art_node_new(node->type + 1);
+    if (newnode == NULL)
+        return NULL;
+    art_node_copy_header(newnode,node);
+    switch (node->type) {
+    case ART_NODE4: {
+        struct art_node4* n4 = (struct art_node4*)node;
+        struct art_node16* n16 = (struct art_node16*)newnode;
+        memcpy(n16->keys,n4->keys,4);
+        memcpy(n16->children,n4->children,sizeof(void*) * 4);
+        break;
+    }
+    case ART_NODE16: {
+        struct art_node16* n16 = (struct art_node16*)node;
+        struct art_node48* n48 = (struct art_node48*)newnode;
+        for (i = 0;i < 16;++i) {
+            n48->index[n16->keys[i]] = i + 1;
+            n48->children[i] = n16->children[i];
+        }
+        break;
+    }
+    case ART_NODE48: {
+        struct art_node48* n48 = (struct art_node48*)node;
+        struct art_node256* n256 = (struct art_node256*)newnode;
+        for (i = 0;i < 256;++i)
+            if (n48->index[i] != 0)
+                n256->children[i] = n48->children[n48->index[i] - 1];
+        break;
+    }
+    }
+    free(node);
+    return newnode;
+}
+static struct art_node* art_node_shrink(struct art_node* node)
+{
+    /* replace 'node' with a copy of the next smaller type; return NULL (keeping
+       'node') if there is no memory for it */
+    int i, j;
+    struct art_node* newnode;
+    newnode = art_node_new(node->type - 1);
+    if (newnode == NULL)
+        return NULL;
+    art_node_copy_header(newnode,node);
+    switch (node->type) {
+    case ART_NODE16: {
+        struct art_node16* n16 = (struct art_node16*)node;
+        struct art_node4* n4 = (struct art_node4*)newnode;
+        memcpy(n4->keys,n16->keys,node->count);
+        memcpy(n4->children,n16->children,sizeof(void*) * node->count);
+        break;
+    }
+    case ART_NODE48: {
+        struct art_node48* n48 = (struct art_node48*)node;
+        struct art_node16* n16 = (struct art_node16*)newnode;
+        for (i = 0,j = 0;i < 256;++i)
+            if (n48->index[i] != 0) {
+                n16->keys[j] = i;
+                n16->children[j++] = n48->children[n48->index[i] - 1];
+            }
+        break;
+    }
+    case ART_NODE256: {
+        struct art_node256* n256 = (struct art_node256*)node;
+        struct art_node48* n48 = (struct art_node48*)newnode;
+        for (i = 0,j = 0;i < 256;++i)
+            if (n256->children[i] != NULL) {
+                n48->index[i] = j + 1;
+                n48->children[j++] = n256->children[i];
+            }
+        break;
+    }
+    }
+    free(node);
+    return newnode;
+}
+static void** art_node_add(void** ref,uint8_t c,void* child)
+{
+    /* add 'child' for byte 'c' (which is not yet present) to the node at '*ref',
+       growing it first if it is full, and return the child's slot (or NULL if the
+       node could not grow) */
+    int i;
+    struct art_node* node = ART_NODE(*ref);
+    static const int capacity[] = {4, 16, 48, 256};
+    if (node->count >= capacity[node->type]) {
+        node = art_node_grow(node);
+        if (node == NULL)
+            return NULL;
+        *ref = ART_TAG(node);
+    }
+    ++node->count;
+    switch (node->type) {
+    case ART_NODE4:
+    case ART_NODE16: {
+        /* Node4 and Node16 share the layout up to the size of their arrays */
+        uint8_t* keys;
+        void** children;
+        if (node->type == ART_NODE4) {
+            keys = ((struct art_node4*)node)->keys;
+            children = ((struct art_node4*)node)->children;
+        }
+        else {
+            keys = ((struct art_node16*)node)->keys;
+            children = ((struct art_node16*)node)->children;
+        }
+        for (i = node->count - 1;i > 0 && keys[i-1] > c;--i) {
+            keys[i] = keys[i-1];
+            children[i] = children[i-1];
+        }
+        keys[i] = c;
+        children[i] = child;
+        return children + i;
+    }
+    case ART_NODE48: {
+        struct art_node48* n48 = (struct art_node48*)node;
+        for (i = 0;n48->children[i] != NULL;++i)
+            ;
+        n48->index[c] = i + 1;
+        n48->children[i] = child;
+        return n48->children + i;
+    }
+    }
+    ((struct art_node256*)node)->children[c] = child;
+    return ((struct art_node256*)node)->children + c;
+}
+static void art_node_remove(struct art_node* node,uint8_t c)
+{
+    /* remove the child for byte 'c' (which must be present) */
+    int i;
+    switch (node->type) {
+    case ART_NODE4:
+    case ART_NODE16: {
+        uint8_t* keys;
+        void** children;
+        if (node->type == ART_NODE4) {
+            keys = ((struct art_node4*)node)->keys;
+            children = ((struct art_node4*)node)->children;
+        }
+        else {
+            keys = ((struct art_node16*)node)->keys;
+            children = ((struct art_node16*)node)->children;
+        }
+        for (i = 0;keys[i] != c;++i)
+            ;
+        for (;i < node->count - 1;++i) {
+            keys[i] = keys[i+1];
+            children[i] = children[i+1];
+        }
+        break;
+    }
+    case ART_NODE48: {
+        struct art_node48* n48 = (struct art_node48*)node;
+        n48->children[n48->index[c] - 1] = NULL;
+        n48->index[c] = 0;
+        break;
+    }
+    case ART_NODE256:
+        ((struct art_node256*)node)->children[c] = NULL;
+        break;
+    }
+    --node->count;
+}
+static void art_node_compact(void** ref)
+{
+    /* restore the invariants of the node at '*ref' after it lost a child or its
+       leaf: a node with a single key below it is replaced by that key, a node
+       with a single child and no leaf is merged into the child (whose path then
+       starts with the node's path and the byte that leads to it) and a sparse
+       node is replaced with a smaller type; since larger types shrink well
+       before then, only a Node4 can be left with a single child; a node is left
+       as it is if there is no memory for its replacement */
+    int n;
+    uint8_t c;
+    void* child;
+    struct art_node* newnode;
+    struct art_leaf* leaf;
+    struct art_node* node = ART_NODE(*ref);
+    if (node->count == 0) {
+        leaf = art_leaf_new(node->leaf);
+        if (leaf == NULL)
+            return;
+        *ref = leaf;
+        free(node);
+        return;
+    }
+    if (node->count == 1 && node->leaf == NULL) {
+        child = art_node_first(node);
+        if (ART_IS_NODE(child)) {
+            uint8_t prefix[ART_PREFIX_MAX];
+            struct art_node* cn = ART_NODE(child);
+            c = ((struct art_node4*)node)->keys[0];
+            n = node->prefixlen < ART_PREFIX_MAX ? node->prefixlen : ART_PREFIX_MAX;
+            memcpy(prefix,node->prefix,n);
+            if (n < ART_PREFIX_MAX)
+                prefix[n++] = c;
+            if (n < ART_PREFIX_MAX)
+                memcpy(prefix + n,cn->prefix,ART_PREFIX_MAX - n);
+            memcpy(cn->prefix,prefix,ART_PREFIX_MAX);
+            cn->prefixlen += node->prefixlen + 1;
+        }
+        *ref = child;
+        free(node);
+        return;
+    }
+    if ((node->type == ART_NODE16 && node->count <= ART_SHRINK16)
+        || (node->type == ART_NODE48 && node->count <= ART_SHRINK48)
+        || (node->type == ART_NODE256 && node->count <= ART_SHRINK256)) {
+        newnode = art_node_shrink(node);
+        if (newnode != NULL)
+            *ref = ART_TAG(newnode);
+    }
+}
+static size_t art_prefix_mismatch(struct artmap* artmap,struct art_node* node,const uint8_t* key,size_t len,size_t depth)
+{
+    /* return the length of the common part of the node's path and the key bytes
+       that follow 'depth'; the part of a long path that is not stored in the
+       node is read from a key below it */
+    size_t i, max;
+    const uint8_t* lb;
+    size_t llen;
+    max = node->prefixlen < len - depth ? node->prefixlen : len - depth;
+    for (i = 0;i < max && i < ART_PREFIX_MAX;++i)
+        if (node->prefix[i] != key[depth+i])
+            return i;
+    if (i < max) {
+        lb = (*artmap->keyfn)(art_node_min_leaf(node),&llen);
+        for (;i < max;++i)
+            if (lb[depth+i] != key[depth+i])
+                return i;
+    }
+    return i;
+}
+static void** art_node_place(void** ref,struct art_leaf* leaf,const uint8_t* bytes,size_t len,size_t depth)
+{
+    /* put the key of 'leaf' (whose bytes agree with the path to the new node at
+       '*ref' up to 'depth') into that node and return the slot of the key; the
+       leaf is freed if the key ends at the node */
+    struct art_node* node = ART_NODE(*ref);
+    if (len == depth) {
+        node->leaf = leaf->key;
+        free(leaf);
+        return &node->leaf;
+    }
+    art_node_add(ref,bytes[depth],leaf);
+    return &leaf->key;
+}
+static void art_node_set_prefix(struct art_node* node,const uint8_t* bytes,size_t len)
+{
+    node->prefixlen = len;
+    memcpy(node->prefix,bytes,len < ART_PREFIX_MAX ? len : ART_PREFIX_MAX);
+}
+
+/* artmap */
+struct artmap* artmap_new(art_key_function keyfn,destructor dstor)
+{
+    struct artmap* artmap;
+    artmap = malloc(sizeof(struct artmap));
+    if (artmap == NULL)
+        return NULL;
+    artmap_init(artmap,keyfn,dstor);
+    return artmap;
+}
+void artmap_free(struct artmap* artmap)
+{
+    if (artmap != NULL) {
+        artmap_delete(artmap);
+        free(artmap);
+    }
+}
+void artmap_init(struct artmap* artmap,art_key_function keyfn,destructor dstor)
+{
+    artmap->count = 0;
+    artmap->root = NULL;
+    artmap->keyfn = keyfn;
+    artmap->dstor = dstor;
+}
+void artmap_delete(struct artmap* artmap)
+{
+    if (artmap->root != NULL)
+        art_node_delete(artmap->root,artmap->dstor);
+    artmap->root = NULL;
+    artmap->count = 0;
+}
+static void** artmap_insert_generic(struct artmap* artmap,void* key,int* inserted)
+{
+    /* return the slot of the key with the same bytes as 'key', inserting 'key'
+       (and setting '*inserted') if there was none; return NULL, leaving the tree
+       unchanged, if there is no memory for the new leaf or nodes */
+    size_t i, len, llen, depth;
+    const uint8_t* bytes, *lb;
+    void** ref, **slot;
+    struct art_node* node, *newnode;
+    struct art_leaf* leaf, *old;
+    bytes = (*artmap->keyfn)(key,&len);
+    *inserted = 0;
+    ref = &artmap->root;
+    depth = 0;
+    while (1) {
+        void* p = *ref;
+        if (p == NULL) {
+            if ((leaf = art_leaf_new(key)) == NULL)
+                return NULL;
+            *ref = leaf;
+            slot = &leaf->key;
+            break;
+        }
+        if (!ART_IS_NODE(p)) {
+            /* a leaf: unless it is the same key, replace it with a node whose
+               path is the part that the two keys have in common */
+            old = p;
+            lb = (*artmap->keyfn)(old->key,&llen);
+            for (i = depth;i < len && i < llen && lb[i] == bytes[i];++i)
+                ;
+            if (i == len && i == llen)
+                return &old->key;
+            leaf = art_leaf_new(key);
+            newnode = art_node_new(ART_NODE4);
+            if (leaf == NULL || newnode == NULL) {
+                free(leaf);
+                free(newnode);
+                return NULL;
+            }
+            art_node_set_prefix(newnode,bytes + depth,i - depth);
+            *ref = ART_TAG(newnode);
+            art_node_place(ref,old,lb,llen,i);
+            slot = art_node_place(ref,leaf,bytes,len,i);
+            break;
+        }
+        node = ART_NODE(p);
+        if (node->prefixlen > 0) {
+            i = art_prefix_mismatch(artmap,node,bytes,len,depth);
+            if (i < node->prefixlen) {
+                /* the key leaves the node's path after 'i' bytes: split the path
+                   with a new node that has the node and the key as children */
+                uint8_t c;
+                leaf = art_leaf_new(key);
+                newnode = art_node_new(ART_NODE4);
+                if (leaf == NULL || newnode == NULL) {
+                    free(leaf);
+                    free(newnode);
+                    return NULL;
+                }
+                art_node_set_prefix(newnode,node->prefix,i);
+                if (node->prefixlen <= ART_PREFIX_MAX) {
+                    c = node->prefix[i];
+                    memmove(node->prefix,node->prefix + i + 1,node->prefixlen - i - 1);
+                    node->prefixlen -= i + 1;
+                }
+                else {
+                    lb = (*artmap->keyfn)(art_node_min_leaf(node),&llen);
+                    c = lb[depth+i];
+                    art_node_set_prefix(node,lb + depth + i + 1,node->prefixlen - i - 1);
+                }
+                *ref = ART_TAG(newnode);
+                art_node_add(ref,c,p);
+                slot = art_node_place(ref,leaf,bytes,len,depth + i);
+                break;
+            }
+            depth += node->prefixlen;
+        }
+        if (depth == len) {
+            if (node->leaf != NULL)
+                return &node->leaf;
+            node->leaf = key;
+            slot = &node->leaf;
+            break;
+        }
+        slot = art_node_find(node,bytes[depth]);
+        if (slot == NULL) {
+            if ((leaf = art_leaf_new(key)) == NULL)
+                return NULL;
+            if (art_node_add(ref,bytes[depth],leaf) == NULL) {
+                free(leaf);
+                return NULL;
+            }
+            slot = &leaf->key;
+            break;
+        }
+        ref = slot;
+        ++depth;
+    }
+    ++artmap->count;
+    *inserted = 1;
+    return slot;
+}
+int artmap_insert(struct artmap* artmap,void* key)
+{
+    /* the user owns 'key' until we successfully add it to the tree;
+       if the insert operation fails then the user is responsible for it */
+    int inserted;
+    artmap_insert_generic(artmap,key,&inserted);
+    return inserted ? 0 : 1;
+}
+void** artmap_find_or_insert(struct artmap* artmap,void* key,int* inserted)
+{
+    /* return the slot that holds the key with the same bytes as 'key'; if there
+       was none then 'key' itself is inserted and '*inserted' is set; the caller
+       may then store a different key with the same bytes in the slot; the slot
+       is only valid until the tree is next modified; NULL is returned if there
+       was no memory to insert 'key' */
+    return artmap_insert_generic(artmap,key,inserted);
+}
+static void** artmap_find_slot(struct artmap* artmap,const void* bytes,size_t len)
+{
+    /* find the slot that holds the key whose bytes are the 'len' bytes at 'bytes'
+       (a leaf's key or a node's 'leaf' member) or return NULL; the stored part of
+       each compressed path is checked on the way down and the key at the end is
+       compared in full */
+    size_t i, n, llen, depth;
+    const uint8_t* key = bytes;
+    const void* lb;
+    void** slot;
+    void* p;
+    struct art_node* node;
+    p = artmap->root;
+    slot = NULL;
+    depth = 0;
+    while (p != NULL) {
+        if (!ART_IS_NODE(p)) {
+            slot = &((struct art_leaf*)p)->key;
+            break;
+        }
+        node = ART_NODE(p);
+        if (node->prefixlen > 0) {
+            if (node->prefixlen > len - depth)
+                return NULL;
+            n = node->prefixlen < ART_PREFIX_MAX ? node->prefixlen : ART_PREFIX_MAX;
+            for (i = 0;i < n;++i)
+                if (node->prefix[i] != key[depth+i])
+                    return NULL;
+            depth += node->prefixlen;
+        }
+        if (depth == len) {
+            slot = &node->leaf;
+            break;
+        }
+        slot = art_node_find(node,key[depth++]);
+        if (slot == NULL)
+            return NULL;
+        p = *slot;
+    }
+    /* compare the key in full: part of a long path may have been skipped */
+    if (slot == NULL || *slot == NULL)
+        return NULL;
+    lb = (*artmap->keyfn)(*slot,&llen);
+    if (llen == len && memcmp(lb,key,len) == 0)
+        return slot;
+    return NULL;
+}
+void* artmap_lookup(struct artmap* artmap,const void* key)
+{
+    size_t len;
+    const void* bytes;
+    bytes = (*artmap->keyfn)(key,&len);
+    return artmap_lookup_bytes(artmap,bytes,len);
+}
+void* artmap_lookup_bytes(struct artmap* artmap,const void* bytes,size_t len)
+{
+    /* find the key whose bytes are the 'len' bytes at 'bytes' */
+    void** slot;
+    slot = artmap_find_slot(artmap,bytes,len);
+    return slot != NULL ? *slot : NULL;
+}
+void* artmap_replace(struct artmap* artmap,void* key)
+{
+    /* replace the key with the same bytes as 'key' with 'key' itself and return
+       the key that was replaced, or NULL if there was none (in which case nothing
+       is inserted); the old key's destructor is not called */
+    size_t len;
+    const void* bytes;
+    void* old;
+    void** slot;
+    bytes = (*artmap->keyfn)(key,&len);
+    slot = artmap_find_slot(artmap,bytes,len);
+    if (slot == NULL)
+        return NULL;
+    old = *slot;
+    *slot = key;
+    return old;
+}
+int artmap_remove(struct artmap* artmap,const void* key)
+{
+    /* find the key's slot, remembering the slot of the node that holds it; the
+       node is then compacted since it may now have too few children */
+    size_t i, n, len, llen, depth;
+    const uint8_t* bytes;
+    const void* lb;
+    void** ref, **nref;
+    void* p;
+    uint8_t c;
+    struct art_node* node;
+    struct art_leaf* leaf;
+    bytes = (*artmap->keyfn)(key,&len);
+    ref = &artmap->root;
+    nref = NULL;
+    depth = 0;
+    c = 0;
+    while (1) {
+        p = *ref;
+        if (p == NULL)
+            return 1;
+        if (!ART_IS_NODE(p)) {
+            leaf = p;
+            p = leaf->key;
+            break;
+        }
+        node = ART_NODE(p);
+        if (node->prefixlen > 0) {
+            if (node->prefixlen > len - depth)
+                return 1;
+            n = node->prefixlen < ART_PREFIX_MAX ? node->prefixlen : ART_PREFIX_MAX;
+            for (i = 0;i < n;++i)
+                if (node->prefix[i] != bytes[depth+i])
+                    return 1;
+            depth += node->prefixlen;
+        }
+        nref = ref;
+        if (depth == len) {
+            ref = &node->leaf;
+            p = node->leaf;
+            leaf = NULL;
+            if (p == NULL)
+                return 1;
+            break;
+        }
+        c = bytes[depth++];
+        ref = art_node_find(node,c);
+        if (ref == NULL)
+            return 1;
+    }
+    lb = (*artmap->keyfn)(p,&llen);
+    if (llen != len || memcmp(lb,bytes,len) != 0)
+        return 1;
+    if (nref == NULL)
+        artmap->root = NULL;
+    else {
+        node = ART_NODE(*nref);
+        if (ref == &node->leaf)
+            node->leaf = NULL;
+        else
+            art_node_remove(node,c);
+        art_node_compact(nref);
+    }
+    free(leaf);
+    /* delete the key: call its destructor if it was specified */
+    if (artmap->dstor != NULL)
+        (*artmap->dstor)(p);
+    --artmap->count;
+    return 0;
+}
+static void artmap_visit(void* p,key_callback_ex callback,void* data)
+{
+    /* visit the keys below 'p' in order: a key that ends at a node comes before
+       the keys in its children, which are visited in the order of their bytes */
+    int i;
+    struct art_node* node;
+    if (!ART_IS_NODE(p)) {
+        (*callback)(((struct art_leaf*)p)->key,data);
+        return;
+    }
+    node = ART_NODE(p);
+    if (node->leaf != NULL)
+        (*callback)(node->leaf,data);
+    switch (node->type) {
+    case ART_NODE4:
+        for (i = 0;i < node->count;++i)
+            artmap_visit(((struct art_node4*)node)->children[i],callback,data);
+        break;
+    case ART_NODE16:
+        for (i = 0;i < node->count;++i)
+            artmap_visit(((struct art_node16*)node)->children[i],callback,data);
+        break;
+    case ART_NODE48: {
+        struct art_node48* n48 = (struct art_node48*)node;
+        for (i = 0;i < 256;++i)
+            if (n48->index[i] != 0)
+                artmap_visit(n48->children[n48->index[i] - 1],callback,data);
+        break;
+    }
+    case ART_NODE256:
+        for (i = 0;i < 256;++i)
+            if (((struct art_node256*)node)->children[i] != NULL)
+                artmap_visit(((struct art_node256*)node)->children[i],callback,data);
+        break;
+    }
+}
+struct art_visit_info
+{
+    key_callback callback;
+    key_filter_callback filter;
+    int num;
+};
+static void artmap_filter_visit(void* key,void* data)
+{
+    struct art_visit_info* info = data;
+    if ((*info->filter)(key))
+        ++info->num;
+}
+int artmap_filter_count(struct artmap* artmap,key_filter_callback callback)
+{
+    struct art_visit_info info;
+    info.filter = callback;
+    info.num = 0;
+    if (artmap->root != NULL)
+        artmap_visit(artmap->root,artmap_filter_visit,&info);
+    return info.num;
+}
+static void artmap_callback_visit(void* key,void* data)
+{
+    (*((struct art_visit_info*)data)->callback)(key);
+}
+void artmap_traversal_inorder(struct artmap* artmap,key_callback callback)
+{
+    struct art_visit_info info;
+    info.callback = callback;
+    if (artmap->root != NULL)
+        artmap_visit(artmap->root,artmap_callback_visit,&info);
+}
+void artmap_traversal_inorder_ex(struct artmap* artmap,key_callback_ex callback,void* data)
+{
+    if (artmap->root != NULL)
+        artmap_visit(artmap->root,callback,data);
+}
@@ -0,0 +1,46 @@
+/* artmap.h */
+#ifndef DSTRUCTS_ARTMAP_H
+#define DSTRUCTS_ARTMAP_H
+#include "dstructs.h"
+#include <stddef.h>
+
+/* an 'art_key_function' returns the bytes of a key object and stores their
+   number in '*len'; the bytes must not change while the key is in a map */
+typedef const void* (*art_key_function)(const void* key,size_t* len);
+
+/* key functions for common key types: a NUL-terminated string (the terminator
+   is not part of the key) and an object whose first member points to one (such
+   as 'struct tree_string_key') */
+const void* art_key_string(const char* key,size_t* len);
+const void* art_key_pstring(const char** key,size_t* len);
+
+/* represents an adaptive radix tree that stores key objects by reference and
+   orders them by their bytes (shorter keys before their extensions); a search
+   follows one byte of the key per level and never calls a comparator: inner
+   nodes have room for 4, 16, 48 or 256 children and grow and shrink between
+   these sizes, and a chain of single-child nodes is compressed into a prefix
+   stored in the node below it; only the key that is found is compared in full;
+   a destructor can be provided (set to NULL if not used) to delete the object
+   before it is freed */
+struct artmap
+{
+    int count;
+    void* root;
+    art_key_function keyfn;
+    destructor dstor;
+};
+struct artmap* artmap_new(art_key_function keyfn,destructor dstor);
+void artmap_free(struct artmap* artmap);
+void artmap_init(struct artmap* artmap,art_key_function keyfn,destructor dstor);
+void artmap_delete(struct artmap* artmap);
+int artmap_insert(struct artmap* artmap,void* key);
+void** artmap_find_or_insert(struct artmap* artmap,void* key,int* inserted);
+void* artmap_lookup(struct artmap* artmap,const void* key);
+void* artmap_lookup_bytes(struct artmap* artmap,const void* bytes,size_t len);
+void* artmap_replace(struct artmap* artmap,void* key);
+int artmap_remove(struct artmap* artmap,const void* key);
+int artmap_filter_count(struct artmap* artmap,key_filter_callback callback);
+void artmap_traversal_inorder(struct artmap* artmap,key_callback callback);
+void artmap_traversal_inorder_ex(struct artmap* artmap,key_callback_ex callback,void* data);
+
+#endif
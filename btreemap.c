@@ -0,0 +1,468 @@
+/* btreemap.c - implements B-tree-based map data structure */
+#include "btreemap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* the tree has minimum degree BTREE_ORDER: every node but the root holds between
+   BTREE_MIN_KEYS and BTREE_MAX_KEYS keys; with an order of 8 a leaf takes two
+   cache lines and an internal node four; insertion splits full nodes and removal
+   fills minimal nodes on the way down, so both finish in a single descent */
+#define BTREE_ORDER 8
+#define BTREE_MAX_KEYS (2*BTREE_ORDER - 1)
+#define BTREE_MIN_KEYS (BTREE_ORDER - 1)
+#define BTREE_NODE_ALIGN 64
+
+/* modes for btree_node_remove */
+#define BTREE_REMOVE_KEY 0
+#define BTREE_REMOVE_MIN 1
+#define BTREE_REMOVE_MAX 2
+
+/* structures used by the implementation */
+struct btree_node
+{
+    int count;
+    int leaf;
+    void* keys[BTREE_MAX_KEYS];
+    struct btree_node* children[]; /* only allocated for internal nodes */
+};
+
+/* btree_node */
+static struct btree_node* btree_node_new(int leaf)
+{
+    size_t size;
+    struct btree_node* node;
+    size = sizeof(struct btree_node);
+    if (!leaf)
+        size += sizeof(struct btree_node*) * (BTREE_MAX_KEYS+1);
+    size = (size + BTREE_NODE_ALIGN-1) & ~(size_t)(BTREE_NODE_ALIGN-1);
+    node = aligned_alloc(BTREE_NODE_ALIGN,size);
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+static void btree_node_delete(struct btree_node* node,destructor dstor)
+{
+    int i;
+    if (dstor != NULL)
+        for (i = 0;i < node->count;++i)
+            (*dstor)(node->keys[i]);
+    if (!node->leaf)
+        for (i = 0;i <= node->count;++i)
+            btree_node_delete(node->children[i],dstor);
+    free(node);
+}
+static int btree_node_search(struct btree_node* node,const void* key,key_comparator compar,int* found)
+{
+    /* binary search: return the index of 'key' (setting 'found') or else the
+       index of the child that would contain it */
+    int lo, hi;
+    lo = 0;
+    hi = node->count;
+    *found = 0;
+    while (lo < hi) {
+        int mid, cmp;
+        mid = (lo + hi) / 2;
+        cmp = (*compar)(key,node->keys[mid]);
+        if (cmp == 0) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+static void btree_node_split_child(struct btree_node* parent,int i)
+{
+    /* 'parent->children[i]' is full; move its upper half into a new right
+       sibling and its median key up into 'parent' (which is not full) */
+    struct btree_node* left, *right;
+    left = parent->children[i];
+    right = btree_node_new(left->leaf);
+    right->count = BTREE_MIN_KEYS;
+    memcpy(right->keys,left->keys+BTREE_ORDER,sizeof(void*) * BTREE_MIN_KEYS);
+    if (!left->leaf)
+        memcpy(right->children,left->children+BTREE_ORDER,sizeof(struct btree_node*) * BTREE_ORDER);
+    left->count = BTREE_MIN_KEYS;
+    memmove(parent->children+i+2,parent->children+i+1,sizeof(struct btree_node*) * (parent->count-i));
+    memmove(parent->keys+i+1,parent->keys+i,sizeof(void*) * (parent->count-i));
+    parent->children[i+1] = right;
+    parent->keys[i] = left->keys[BTREE_MIN_KEYS];
+    ++parent->count;
+}
+static void btree_node_merge_children(struct btree_node* parent,int i)
+{
+    /* merge 'parent->children[i+1]' and the separator at 'i' into 'parent->children[i]';
+       both children hold the minimum number of keys */
+    struct btree_node* left, *right;
+    left = parent->children[i];
+    right = parent->children[i+1];
+    left->keys[left->count] = parent->keys[i];
+    memcpy(left->keys+left->count+1,right->keys,sizeof(void*) * right->count);
+    if (!left->leaf)
+        memcpy(left->children+left->count+1,right->children,sizeof(struct btree_node*) * (right->count+1));
+    left->count += right->count + 1;
+    memmove(parent->keys+i,parent->keys+i+1,sizeof(void*) * (parent->count-i-1));
+    memmove(parent->children+i+1,parent->children+i+2,sizeof(struct btree_node*) * (parent->count-i-1));
+    --parent->count;
+    free(right);
+}
+static int btree_node_fill_child(struct btree_node* parent,int i)
+{
+    /* make sure 'parent->children[i]' holds more than the minimum number of keys
+       before the removal descends into it: borrow a key through the parent from a
+       sibling that can spare one or else merge with a sibling; return the index
+       of the child to descend into (which changes if it merged to the left) */
+    struct btree_node* child, *sib;
+    child = parent->children[i];
+    if (child->count > BTREE_MIN_KEYS)
+        return i;
+    if (i > 0 && (sib = parent->children[i-1])->count > BTREE_MIN_KEYS) {
+        /* rotate the left sibling's last key through the parent */
+        memmove(child->keys+1,child->keys,sizeof(void*) * child->count);
+        if (!child->leaf) {
+            memmove(child->children+1,child->children,sizeof(struct btree_node*) * (child->count+1));
+            child->children[0] = sib->children[sib->count];
+        }
+        child->keys[0] = parent->keys[i-1];
+        parent->keys[i-1] = sib->keys[sib->count-1];
+        ++child->count;
+        --sib->count;
+        return i;
+    }
+    if (i < parent->count && (sib = parent->children[i+1])->count > BTREE_MIN_KEYS) {
+        /* rotate the right sibling's first key through the parent */
+        child->keys[child->count] = parent->keys[i];
+        parent->keys[i] = sib->keys[0];
+        memmove(sib->keys,sib->keys+1,sizeof(void*) * (sib->count-1));
+        if (!child->leaf) {
+            child->children[child->count+1] = sib->children[0];
+            memmove(sib->children,sib->children+1,sizeof(struct btree_node*) * sib->count);
+        }
+        ++child->count;
+        --sib->count;
+        return i;
+    }
+    if (i < parent->count) {
+        btree_node_merge_children(parent,i);
+        return i;
+    }
+    btree_node_merge_children(parent,i-1);
+    return i-1;
+}
+static void* btree_node_remove(struct btree_node* node,const void* key,int mode,key_comparator compar)
+{
+    /* remove a key from the subtree rooted at 'node' and return it (or NULL if
+       it was not found); depending on 'mode' this is the key equal to 'key' or
+       the subtree's least or greatest key; 'node' must hold more than the
+       minimum number of keys unless it is the root */
+    while (1) {
+        int i, found;
+        void* result;
+        if (mode == BTREE_REMOVE_KEY)
+            i = btree_node_search(node,key,compar,&found);
+        else {
+            i = mode == BTREE_REMOVE_MIN ? 0 : node->count - node->leaf;
+            found = node->leaf;
+        }
+        if (node->leaf) {
+            if (!found)
+                return NULL;
+            result = node->keys[i];
+            memmove(node->keys+i,node->keys+i+1,sizeof(void*) * (node->count-i-1));
+            --node->count;
+            return result;
+        }
+        if (found) {
+            /* the key is in an internal node: replace it with its predecessor or
+               successor if a child can spare one; otherwise merge the children
+               around it and remove it from the merged node */
+            result = node->keys[i];
+            if (node->children[i]->count > BTREE_MIN_KEYS) {
+                node->keys[i] = btree_node_remove(node->children[i],NULL,BTREE_REMOVE_MAX,compar);
+                return result;
+            }
+            if (node->children[i+1]->count > BTREE_MIN_KEYS) {
+                node->keys[i] = btree_node_remove(node->children[i+1],NULL,BTREE_REMOVE_MIN,compar);
+                return result;
+            }
+            btree_node_merge_children(node,i);
+            node = node->children[i];
+            continue;
+        }
+        node = node->children[btree_node_fill_child(node,i)];
+    }
+}
+static uint64_t btree_capacity(int height)
+{
+    /* the most keys a tree of 'height' levels can hold */
+    uint64_t cap = 1;
+    while (height-- > 0)
+        cap *= 2*BTREE_ORDER;
+    return cap - 1;
+}
+static struct btree_node* btree_build(void** keys,int size,int height)
+{
+    /* build a subtree of 'height' levels from the sorted keys; the keys are split
+       evenly between the fewest children that can hold them, which keeps every
+       child at least half full */
+    int i, c, pos, per, extra;
+    uint64_t sub;
+    struct btree_node* node;
+    node = btree_node_new(height == 1);
+    if (height == 1) {
+        memcpy(node->keys,keys,sizeof(void*) * size);
+        node->count = size;
+        return node;
+    }
+    sub = btree_capacity(height-1) + 1;
+    c = (int)((size + sub) / sub);
+    if (c < 2)
+        c = 2;
+    per = (size - (c-1)) / c;
+    extra = (size - (c-1)) % c;
+    pos = 0;
+    for (i = 0;i < c;++i) {
+        int len = per + (i < extra);
+        node->children[i] = btree_build(keys+pos,len,height-1);
+        pos += len;
+        if (i < c-1)
+            node->keys[i] = keys[pos++];
+    }
+    node->count = c-1;
+    return node;
+}
+static void btree_traversal_inorder(struct btree_node* node,key_callback callback)
+{
+    int i;
+    for (i = 0;i < node->count;++i) {
+        if (!node->leaf)
+            btree_traversal_inorder(node->children[i],callback);
+        (*callback)(node->keys[i]);
+    }
+    if (!node->leaf)
+        btree_traversal_inorder(node->children[i],callback);
+}
+static void btree_traversal_inorder_ex(struct btree_node* node,key_callback_ex callback,void* data)
+{
+    int i;
+    for (i = 0;i < node->count;++i) {
+        if (!node->leaf)
+            btree_traversal_inorder_ex(node->children[i],callback,data);
+        (*callback)(node->keys[i],data);
+    }
+    if (!node->leaf)
+        btree_traversal_inorder_ex(node->children[i],callback,data);
+}
+static void btree_filter_count(struct btree_node* node,int* num,key_filter_callback callback)
+{
+    int i;
+    for (i = 0;i < node->count;++i) {
+        if (!node->leaf)
+            btree_filter_count(node->children[i],num,callback);
+        if ( (*callback)(node->keys[i]) )
+            ++ (*num);
+    }
+    if (!node->leaf)
+        btree_filter_count(node->children[i],num,callback);
+}
+
+/* btreemap */
+struct btreemap* btreemap_new(key_comparator compar,destructor dstor)
+{
+    struct btreemap* btreemap;
+    btreemap = malloc(sizeof(struct btreemap));
+    if (btreemap == NULL)
+        return NULL;
+    btreemap_init(btreemap,compar,dstor);
+    return btreemap;
+}
+struct btreemap* btreemap_new_ex(key_comparator compar,destructor dstor,void** keys,int size)
+{
+    struct btreemap* btreemap;
+    btreemap = malloc(sizeof(struct btreemap));
+    if (btreemap == NULL)
+        return NULL;
+    btreemap_init_ex(btreemap,compar,dstor,keys,size);
+    return btreemap;
+}
+void btreemap_free(struct btreemap* btreemap)
+{
+    if (btreemap != NULL) {
+        btreemap_delete(btreemap);
+        free(btreemap);
+    }
+}
+void btreemap_init(struct btreemap* btreemap,key_comparator compar,destructor dstor)
+{
+    btreemap->count = 0;
+    btreemap->root = NULL;
+    btreemap->compar = compar;
+    btreemap->dstor = dstor;
+}
+void btreemap_init_ex(struct btreemap* btreemap,key_comparator compar,destructor dstor,void** keys,int size)
+{
+    /* as with treemap_init_ex: 'keys' is sorted and any duplicate keys are left in
+       'keys' (terminated by NULL) for the caller to dispose of */
+    int i, j, k, height;
+    void** arr, *plast;
+    btreemap_init(btreemap,compar,dstor);
+    if (size <= 0)
+        return;
+    qsort(keys,size,sizeof(void*),compar);
+    arr = malloc(sizeof(void*) * size);
+    i = 0;
+    j = 0;
+    k = 0;
+    plast = NULL;
+    while (1) {
+        if (plast != NULL)
+            while (j<size && (*compar)(plast,keys[j])==0)
+                keys[k++] = keys[j++];
+        if (j >= size)
+            break;
+        arr[i] = keys[j];
+        plast = keys[j];
+        ++i, ++j;
+    }
+    if (k < size)
+        keys[k] = NULL;
+    height = 1;
+    while (btree_capacity(height) < (uint64_t)i)
+        ++height;
+    btreemap->root = btree_build(arr,i,height);
+    btreemap->count = i;
+    free(arr);
+}
+void btreemap_delete(struct btreemap* btreemap)
+{
+    if (btreemap->root != NULL)
+        btree_node_delete(btreemap->root,btreemap->dstor);
+    btreemap->root = NULL;
+    btreemap->count = 0;
+}
+void** btreemap_find_or_insert(struct btreemap* btreemap,void* key,int* inserted)
+{
+    /* return the slot that holds the key equal to 'key'; if there was none then
+       'key' itself is inserted and '*inserted' is set; the slot is only valid
+       until the tree is next modified */
+    int i, found;
+    struct btree_node* node;
+    *inserted = 0;
+    if (btreemap->root == NULL)
+        btreemap->root = btree_node_new(1);
+    else if (btreemap->root->count == BTREE_MAX_KEYS) {
+        /* split a full root so the descent always has room to push a key up */
+        node = btree_node_new(0);
+        node->children[0] = btreemap->root;
+        btree_node_split_child(node,0);
+        btreemap->root = node;
+    }
+    node = btreemap->root;
+    while (1) {
+        i = btree_node_search(node,key,btreemap->compar,&found);
+        if (found)
+            return node->keys + i;
+        if (node->leaf)
+            break;
+        if (node->children[i]->count == BTREE_MAX_KEYS) {
+            int cmp;
+            btree_node_split_child(node,i);
+            cmp = (*btreemap->compar)(key,node->keys[i]);
+            if (cmp == 0)
+                return node->keys + i;
+            if (cmp > 0)
+                ++i;
+        }
+        node = node->children[i];
+    }
+    memmove(node->keys+i+1,node->keys+i,sizeof(void*) * (node->count-i));
+    node->keys[i] = key;
+    ++node->count;
+    ++btreemap->count;
+    *inserted = 1;
+    return node->keys + i;
+}
+int btreemap_insert(struct btreemap* btreemap,void* key)
+{
+    /* the user owns 'key' until we successfully add it to the tree;
+       if the insert operation fails then the user is responsible for it */
+    int inserted;
+    btreemap_find_or_insert(btreemap,key,&inserted);
+    return inserted ? 0 : 1;
+}
+static void** btreemap_search(struct btreemap* btreemap,const void* key)
+{
+    int i, found;
+    struct btree_node* node;
+    node = btreemap->root;
+    while (node != NULL) {
+        i = btree_node_search(node,key,btreemap->compar,&found);
+        if (found)
+            return node->keys + i;
+        if (node->leaf)
+            break;
+        node = node->children[i];
+    }
+    return NULL;
+}
+void* btreemap_lookup(struct btreemap* btreemap,const void* key)
+{
+    void** slot;
+    slot = btreemap_search(btreemap,key);
+    return slot != NULL ? *slot : NULL;
+}
+void* btreemap_replace(struct btreemap* btreemap,void* key)
+{
+    /* replace the key equal to 'key' with 'key' itself and return the key that
+       was replaced, or NULL if there was none (in which case nothing is inserted);
+       the old key's destructor is not called */
+    void* old;
+    void** slot;
+    slot = btreemap_search(btreemap,key);
+    if (slot == NULL)
+        return NULL;
+    old = *slot;
+    *slot = key;
+    return old;
+}
+int btreemap_remove(struct btreemap* btreemap,const void* key)
+{
+    void* result;
+    struct btree_node* root;
+    root = btreemap->root;
+    if (root == NULL)
+        return 1;
+    result = btree_node_remove(root,key,BTREE_REMOVE_KEY,btreemap->compar);
+    /* the root loses its last key when its only two children merge */
+    if (root->count == 0) {
+        btreemap->root = root->leaf ? NULL : root->children[0];
+        free(root);
+    }
+    if (result == NULL)
+        return 1;
+    if (btreemap->dstor != NULL)
+        (*btreemap->dstor)(result);
+    --btreemap->count;
+    return 0;
+}
+int btreemap_filter_count(struct btreemap* btreemap,key_filter_callback callback)
+{
+    int num = 0;
+    if (btreemap->root != NULL)
+        btree_filter_count(btreemap->root,&num,callback);
+    return num;
+}
+void btreemap_traversal_inorder(struct btreemap* btreemap,key_callback callback)
+{
+    if (btreemap->root != NULL)
+        btree_traversal_inorder(btreemap->root,callback);
+}
+void btreemap_traversal_inorder_ex(struct btreemap* btreemap,key_callback_ex callback,void* data)
+{
+    if (btreemap->root != NULL)
+        btree_traversal_inorder_ex(btreemap->root,callback,data);
+}
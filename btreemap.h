@@ -0,0 +1,37 @@
+/* btreemap.h */
+#ifndef DSTRUCTS_BTREEMAP_H
+#define DSTRUCTS_BTREEMAP_H
+#include "dstructs.h"
+
+struct btree_node;
+
+/* represents a B-tree that stores key objects by reference; it provides the same
+   interface as 'struct treemap' (with the prefix 'btreemap_' in place of
+   'treemap_') but each node holds up to 15 keys and is sized to whole cache
+   lines, so a search touches a few wide nodes instead of many 2-3 nodes; a
+   comparator must be used to compare two key object references; a destructor
+   can be provided (set to NULL if not used) to delete the object before it is
+   freed */
+struct btreemap
+{
+    int count;
+    struct btree_node* root;
+    key_comparator compar;
+    destructor dstor;
+};
+struct btreemap* btreemap_new(key_comparator compar,destructor dstor);
+struct btreemap* btreemap_new_ex(key_comparator compar,destructor dstor,void** keys,int size);
+void btreemap_free(struct btreemap* btreemap);
+void btreemap_init(struct btreemap* btreemap,key_comparator compar,destructor dstor);
+void btreemap_init_ex(struct btreemap* btreemap,key_comparator compar,destructor dstor,void** keys,int size);
+void btreemap_delete(struct btreemap* btreemap);
+int btreemap_insert(struct btreemap* btreemap,void* key);
+void** btreemap_find_or_insert(struct btreemap* btreemap,void* key,int* inserted);
+void* btreemap_lookup(struct btreemap* btreemap,const void* key);
+void* btreemap_replace(struct btreemap* btreemap,void* key);
+int btreemap_remove(struct btreemap* btreemap,const void* key);
+int btreemap_filter_count(struct btreemap* btreemap,key_filter_callback callback);
+void btreemap_traversal_inorder(struct btreemap* btreemap,key_callback callback);
+void btreemap_traversal_inorder_ex(struct btreemap* btreemap,key_callback_ex callback,void* data);
+
+#endif
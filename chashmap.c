@@ -0,0 +1,392 @@
+/* chashmap.c - implements a hash table with lock-free lookups */
+#include "chashmap.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+#define CHASH_DEFAULT_SIZE 64
+#define CHASH_DEFAULT_STRIPES 64
+#define CHASH_CACHE_LINE 64
+
+/* structures used by the implementation */
+struct chash_node
+{
+    void* key;
+    uint64_t hash;
+    _Atomic(struct chash_node*) next;
+    /* reclamation info; only used once the node has been unlinked */
+    struct chash_node* limbo;
+    destructor dstor;
+};
+struct chash_table
+{
+    int size; /* power of two; a multiple of the stripe count so that each bucket belongs to one stripe */
+    struct chash_table* limbo;
+    _Atomic(struct chash_node*) buckets[];
+};
+struct chash_stripe
+{
+    _Alignas(CHASH_CACHE_LINE) pthread_mutex_t lock;
+};
+
+/* epoch-based reclamation: a reader registers itself in one of two counters
+   (selected by the parity of the global epoch) of its thread's slot; memory that
+   a writer unlinks while the epoch is 'e' goes on limbo list e%3; the epoch may
+   only advance from 'e' to 'e+1' once no reader is registered under the parity of
+   'e-1'; at that point no reader that started before the epoch became 'e' is left
+   so the memory retired during epoch 'e-1' is freed */
+#define CHASH_READER_SLOTS 64
+#define CHASH_RETIRE_BATCH 64
+struct chash_reader
+{
+    _Alignas(CHASH_CACHE_LINE) atomic_long active[2];
+};
+struct chash_epoch
+{
+    pthread_mutex_t lock;
+    atomic_ulong epoch;
+    int retired; /* retirements since the epoch last advanced */
+    struct chash_node* nodes[3];
+    struct chash_table* tables[3];
+    struct chash_reader readers[CHASH_READER_SLOTS];
+};
+static atomic_int chash_reader_next;
+static _Thread_local int chash_reader_slot = -1;
+
+/* chash_epoch */
+static struct chash_epoch* chash_epoch_new()
+{
+    int i;
+    struct chash_epoch* ep;
+    ep = aligned_alloc(CHASH_CACHE_LINE,sizeof(struct chash_epoch));
+    pthread_mutex_init(&ep->lock,NULL);
+    atomic_init(&ep->epoch,0);
+    ep->retired = 0;
+    for (i = 0;i < 3;++i) {
+        ep->nodes[i] = NULL;
+        ep->tables[i] = NULL;
+    }
+    for (i = 0;i < CHASH_READER_SLOTS;++i) {
+        atomic_init(&ep->readers[i].active[0],0);
+        atomic_init(&ep->readers[i].active[1],0);
+    }
+    return ep;
+}
+static void chash_epoch_free_list(struct chash_epoch* ep,int index)
+{
+    struct chash_node* node;
+    struct chash_table* table;
+    node = ep->nodes[index];
+    while (node != NULL) {
+        struct chash_node* tmp = node->limbo;
+        if (node->dstor != NULL)
+            (*node->dstor)(node->key);
+        free(node);
+        node = tmp;
+    }
+    table = ep->tables[index];
+    while (table != NULL) {
+        struct chash_table* tmp = table->limbo;
+        free(table);
+        table = tmp;
+    }
+    ep->nodes[index] = NULL;
+    ep->tables[index] = NULL;
+}
+static void chash_epoch_free(struct chash_epoch* ep)
+{
+    int i;
+    for (i = 0;i < 3;++i)
+        chash_epoch_free_list(ep,i);
+    pthread_mutex_destroy(&ep->lock);
+    free(ep);
+}
+static void chash_epoch_try_advance(struct chash_epoch* ep)
+{
+    /* the caller must hold 'ep->lock'; this never waits for readers: if some are
+       still registered under the old parity, the next retirement tries again */
+    int i;
+    unsigned long e;
+    e = atomic_load(&ep->epoch);
+    for (i = 0;i < CHASH_READER_SLOTS;++i)
+        if (atomic_load(&ep->readers[i].active[(e+1) & 1]) != 0)
+            return;
+    atomic_store(&ep->epoch,e+1);
+    chash_epoch_free_list(ep,(e+2) % 3);
+    ep->retired = 0;
+}
+static void chash_epoch_retire(struct chash_epoch* ep,struct chash_node* first,struct chash_node* last,struct chash_table* table,int count)
+{
+    /* retire the list of nodes 'first' through 'last' (linked by 'limbo') and
+       optionally 'table' */
+    int index;
+    pthread_mutex_lock(&ep->lock);
+    index = atomic_load(&ep->epoch) % 3;
+    if (first != NULL) {
+        last->limbo = ep->nodes[index];
+        ep->nodes[index] = first;
+    }
+    if (table != NULL) {
+        table->limbo = ep->tables[index];
+        ep->tables[index] = table;
+    }
+    ep->retired += count;
+    if (ep->retired >= CHASH_RETIRE_BATCH)
+        chash_epoch_try_advance(ep);
+    pthread_mutex_unlock(&ep->lock);
+}
+
+/* chash_table */
+static struct chash_table* chash_table_new(int size)
+{
+    int i;
+    struct chash_table* table;
+    table = malloc(sizeof(struct chash_table) + sizeof(_Atomic(struct chash_node*)) * size);
+    table->size = size;
+    table->limbo = NULL;
+    for (i = 0;i < size;++i)
+        atomic_init(&table->buckets[i],NULL);
+    return table;
+}
+static void chash_table_free(struct chash_table* table,destructor dstor)
+{
+    int i;
+    for (i = 0;i < table->size;++i) {
+        struct chash_node* node;
+        node = atomic_load_explicit(&table->buckets[i],memory_order_relaxed);
+        while (node != NULL) {
+            struct chash_node* tmp = atomic_load_explicit(&node->next,memory_order_relaxed);
+            if (dstor != NULL)
+                (*dstor)(node->key);
+            free(node);
+            node = tmp;
+        }
+    }
+    free(table);
+}
+
+/* chashmap */
+static void chashmap_grow(struct chashmap* cm,struct chash_table* table)
+{
+    /* the chains cannot be relinked in place since readers may be walking them;
+       copy every node into a new table, publish it and retire the old one */
+    int i;
+    struct chash_table* ntable;
+    struct chash_node* first, *last;
+    for (i = 0;i < cm->cm_nstripes;++i)
+        pthread_mutex_lock(&cm->cm_stripes[i].lock);
+    if (atomic_load_explicit(&cm->cm_table,memory_order_relaxed) != table) {
+        /* another writer grew the table first */
+        for (i = cm->cm_nstripes-1;i >= 0;--i)
+            pthread_mutex_unlock(&cm->cm_stripes[i].lock);
+        return;
+    }
+    ntable = chash_table_new(table->size * 2);
+    first = last = NULL;
+    for (i = 0;i < table->size;++i) {
+        struct chash_node* node;
+        node = atomic_load_explicit(&table->buckets[i],memory_order_relaxed);
+        while (node != NULL) {
+            struct chash_node* copy;
+            _Atomic(struct chash_node*)* bucket;
+            copy = malloc(sizeof(struct chash_node));
+            copy->key = node->key;
+            copy->hash = node->hash;
+            bucket = ntable->buckets + (node->hash & (ntable->size-1));
+            atomic_init(&copy->next,atomic_load_explicit(bucket,memory_order_relaxed));
+            atomic_init(bucket,copy);
+            /* chain the old node onto the retire list */
+            node->dstor = NULL;
+            node->limbo = NULL;
+            if (last == NULL)
+                first = node;
+            else
+                last->limbo = node;
+            last = node;
+            node = atomic_load_explicit(&node->next,memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&cm->cm_table,ntable,memory_order_release);
+    for (i = cm->cm_nstripes-1;i >= 0;--i)
+        pthread_mutex_unlock(&cm->cm_stripes[i].lock);
+    chash_epoch_retire(cm->cm_epoch,first,last,table,CHASH_RETIRE_BATCH);
+}
+
+struct chashmap* chashmap_new(int size,int nstripes,hash64_function hash,key_comparator compar)
+{
+    struct chashmap* cm;
+    cm = malloc(sizeof(struct chashmap));
+    if (cm == NULL)
+        return NULL;
+    chashmap_init(cm,size,nstripes,hash,compar);
+    return cm;
+}
+void chashmap_free(struct chashmap* cm)
+{
+    chashmap_delete(cm);
+    free(cm);
+}
+void chashmap_free_ex(struct chashmap* cm,destructor dstor)
+{
+    chashmap_delete_ex(cm,dstor);
+    free(cm);
+}
+void chashmap_init(struct chashmap* cm,int size,int nstripes,hash64_function hash,key_comparator compar)
+{
+    /* 'size' is the initial size of the table and 'nstripes' the number of write
+       locks; both are rounded up to a power of two (pass 0 to use the defaults) */
+    int i, n;
+    if (nstripes <= 0)
+        nstripes = CHASH_DEFAULT_STRIPES;
+    if (size <= 0)
+        size = CHASH_DEFAULT_SIZE;
+    for (n = 1;n < nstripes;n <<= 1)
+        ;
+    cm->cm_nstripes = n;
+    while (n < size)
+        n <<= 1;
+    atomic_init(&cm->cm_table,chash_table_new(n));
+    atomic_init(&cm->cm_count,0);
+    cm->cm_stripes = aligned_alloc(CHASH_CACHE_LINE,sizeof(struct chash_stripe) * cm->cm_nstripes);
+    for (i = 0;i < cm->cm_nstripes;++i)
+        pthread_mutex_init(&cm->cm_stripes[i].lock,NULL);
+    cm->cm_epoch = chash_epoch_new();
+    cm->cm_hash = hash;
+    cm->cm_seed = hash_random_seed();
+    cm->cm_compar = compar;
+}
+void chashmap_delete(struct chashmap* cm)
+{
+    chashmap_delete_ex(cm,NULL);
+}
+void chashmap_delete_ex(struct chashmap* cm,destructor dstor)
+{
+    /* no other thread may use the map at this point */
+    int i;
+    chash_table_free(atomic_load(&cm->cm_table),dstor);
+    chash_epoch_free(cm->cm_epoch);
+    for (i = 0;i < cm->cm_nstripes;++i)
+        pthread_mutex_destroy(&cm->cm_stripes[i].lock);
+    free(cm->cm_stripes);
+    atomic_store(&cm->cm_table,NULL);
+    atomic_store(&cm->cm_count,0);
+    cm->cm_nstripes = 0;
+    cm->cm_stripes = NULL;
+    cm->cm_epoch = NULL;
+    cm->cm_hash = NULL;
+    cm->cm_compar = NULL;
+}
+int chashmap_insert(struct chashmap* cm,void* key)
+{
+    int size;
+    uint64_t hash;
+    struct chash_stripe* stripe;
+    struct chash_table* table;
+    struct chash_node* node;
+    _Atomic(struct chash_node*)* bucket;
+    hash = (*cm->cm_hash)(key,cm->cm_seed);
+    stripe = cm->cm_stripes + (hash & (cm->cm_nstripes-1));
+    pthread_mutex_lock(&stripe->lock);
+    /* the table cannot be replaced while we hold a stripe */
+    table = atomic_load_explicit(&cm->cm_table,memory_order_acquire);
+    bucket = table->buckets + (hash & (table->size-1));
+    for (node = atomic_load_explicit(bucket,memory_order_relaxed);node != NULL;
+         node = atomic_load_explicit(&node->next,memory_order_relaxed)) {
+        if (node->hash == hash && (*cm->cm_compar)(node->key,key) == 0) {
+            pthread_mutex_unlock(&stripe->lock);
+            return 1;
+        }
+    }
+    /* fill in the node before it is published at the head of the chain */
+    node = malloc(sizeof(struct chash_node));
+    node->key = key;
+    node->hash = hash;
+    atomic_init(&node->next,atomic_load_explicit(bucket,memory_order_relaxed));
+    atomic_store_explicit(bucket,node,memory_order_release);
+    /* 'table' may be retired once the stripe is released; only its address is
+       used after that point */
+    size = table->size;
+    pthread_mutex_unlock(&stripe->lock);
+    if (atomic_fetch_add(&cm->cm_count,1) >= size)
+        chashmap_grow(cm,table);
+    return 0;
+}
+void* chashmap_lookup(struct chashmap* cm,const void* key)
+{
+    int token;
+    uint64_t hash;
+    void* result;
+    struct chash_table* table;
+    struct chash_node* node;
+    hash = (*cm->cm_hash)(key,cm->cm_seed);
+    result = NULL;
+    token = chashmap_read_begin(cm);
+    table = atomic_load_explicit(&cm->cm_table,memory_order_acquire);
+    node = atomic_load_explicit(table->buckets + (hash & (table->size-1)),memory_order_acquire);
+    while (node != NULL) {
+        if (node->hash == hash && (*cm->cm_compar)(node->key,key) == 0) {
+            result = node->key;
+            break;
+        }
+        node = atomic_load_explicit(&node->next,memory_order_acquire);
+    }
+    chashmap_read_end(cm,token);
+    return result;
+}
+static void* chashmap_remove_generic(struct chashmap* cm,const void* key,destructor dstor)
+{
+    uint64_t hash;
+    struct chash_stripe* stripe;
+    struct chash_table* table;
+    struct chash_node* node;
+    _Atomic(struct chash_node*)* link;
+    hash = (*cm->cm_hash)(key,cm->cm_seed);
+    stripe = cm->cm_stripes + (hash & (cm->cm_nstripes-1));
+    pthread_mutex_lock(&stripe->lock);
+    table = atomic_load_explicit(&cm->cm_table,memory_order_acquire);
+    link = table->buckets + (hash & (table->size-1));
+    while ((node = atomic_load_explicit(link,memory_order_relaxed)) != NULL) {
+        if (node->hash == hash && (*cm->cm_compar)(node->key,key) == 0) {
+            void* r;
+            /* readers already on 'node' can still follow its 'next' pointer */
+            atomic_store_explicit(link,atomic_load_explicit(&node->next,memory_order_relaxed),memory_order_release);
+            pthread_mutex_unlock(&stripe->lock);
+            atomic_fetch_sub(&cm->cm_count,1);
+            r = node->key;
+            node->dstor = dstor;
+            chash_epoch_retire(cm->cm_epoch,node,node,NULL,1);
+            return r;
+        }
+        link = &node->next;
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return NULL;
+}
+int chashmap_remove(struct chashmap* cm,const void* key)
+{
+    if (chashmap_remove_generic(cm,key,NULL) == NULL)
+        return 1;
+    return 0;
+}
+int chashmap_remove_ex(struct chashmap* cm,const void* key,destructor dstor)
+{
+    /* 'dstor' is called once no reader can still be using the key */
+    if (chashmap_remove_generic(cm,key,dstor) == NULL)
+        return 1;
+    return 0;
+}
+int chashmap_read_begin(struct chashmap* cm)
+{
+    /* the returned token must be passed to chashmap_read_end on the same thread */
+    int token;
+    struct chash_reader* reader;
+    if (chash_reader_slot < 0)
+        chash_reader_slot = atomic_fetch_add(&chash_reader_next,1) % CHASH_READER_SLOTS;
+    reader = cm->cm_epoch->readers + chash_reader_slot;
+    token = atomic_load(&cm->cm_epoch->epoch) & 1;
+    atomic_fetch_add(&reader->active[token],1);
+    return token;
+}
+void chashmap_read_end(struct chashmap* cm,int token)
+{
+    atomic_fetch_sub(&cm->cm_epoch->readers[chash_reader_slot].active[token],1);
+}
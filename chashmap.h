@@ -0,0 +1,42 @@
+/* chashmap.h */
+#ifndef DSTRUCTS_CHASHMAP_H
+#define DSTRUCTS_CHASHMAP_H
+#include "hashmap.h"
+#include <stdatomic.h>
+
+struct chash_table;
+struct chash_stripe;
+struct chash_epoch;
+
+/* represents a hash table that may be shared between threads; lookups never
+   take a lock: they walk chains that writers publish with atomic stores; writers
+   lock one of 'cm_nstripes' stripes (chosen by the key's hash) so that writes to
+   different stripes proceed in parallel; unlinked chain nodes (and any destructor
+   call on their keys) are deferred until no reader can still see them; a lookup
+   result remains valid inside a chashmap_read_begin/chashmap_read_end section
+   even if another thread removes the key meanwhile */
+struct chashmap
+{
+    _Atomic(struct chash_table*) cm_table;
+    atomic_int cm_count;
+    int cm_nstripes; /* power of two */
+    struct chash_stripe* cm_stripes;
+    struct chash_epoch* cm_epoch;
+    hash64_function cm_hash;
+    uint64_t cm_seed;
+    key_comparator cm_compar;
+};
+struct chashmap* chashmap_new(int size,int nstripes,hash64_function hash,key_comparator compar);
+void chashmap_free(struct chashmap* cm);
+void chashmap_free_ex(struct chashmap* cm,destructor dstor);
+void chashmap_init(struct chashmap* cm,int size,int nstripes,hash64_function hash,key_comparator compar);
+void chashmap_delete(struct chashmap* cm);
+void chashmap_delete_ex(struct chashmap* cm,destructor dstor);
+int chashmap_insert(struct chashmap* cm,void* key);
+void* chashmap_lookup(struct chashmap* cm,const void* key);
+int chashmap_remove(struct chashmap* cm,const void* key);
+int chashmap_remove_ex(struct chashmap* cm,const void* key,destructor dstor);
+int chashmap_read_begin(struct chashmap* cm);
+void chashmap_read_end(struct chashmap* cm,int token);
+
+#endif
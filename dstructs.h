@@ -15,11 +15,19 @@ typedef int (*key_comparator)(const void* left,const void* right);
 typedef void (*key_callback)(void* key);
 typedef void (*key_callback_ex)(void* key,void* data);
 
+/* Performs operation on 'key' when called; returns non-zero to stop visiting
+ * any further keys.
+ */
+typedef int (*key_visitor)(void* key,void* data);
+
+/* Combines the partial result 'src' into 'dst'. */
+typedef void (*key_reducer)(void* dst,void* src);
+
 /* Perform operation on 'key' when called (used for filtering keys). */
 typedef int (*key_filter_callback)(void* key);
 
 /* common comparators */
 static inline int intcmp(const int* left,const int* right)
-{ return *left - *right; }
+{ return (*left > *right) - (*left < *right); }
 
 #endif
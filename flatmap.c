@@ -0,0 +1,304 @@
+/* flatmap.c - implements an open-addressing (SwissTable-style) hash table */
+#include "flatmap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* control byte values; a full slot stores the low 7 bits of its key's hash so
+   the high bit distinguishes between full and empty/deleted slots */
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
+#define GROUP_WIDTH 16
+#define FLATMAP_MIN_CAPACITY 16
+
+/* group operations: they examine the 16 control bytes at 'ctrl' and return a
+   bitmask in which bit 'i' is set if byte 'i' matches */
+#if defined(__SSE2__)
+static inline unsigned int group_match(const unsigned char* ctrl,unsigned char h2)
+{
+    __m128i grp = _mm_loadu_si128((const __m128i*)ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(grp,_mm_set1_epi8((char)h2)));
+}
+static inline unsigned int group_match_empty(const unsigned char* ctrl)
+{
+    return group_match(ctrl,CTRL_EMPTY);
+}
+static inline unsigned int group_match_free(const unsigned char* ctrl)
+{
+    /* empty and deleted slots both have the high bit set */
+    return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+#else
+/* portable fallback: process the group as two 64-bit words (SWAR) */
+#define SWAR_LSB 0x0101010101010101ULL
+#define SWAR_MSB 0x8080808080808080ULL
+static inline uint64_t swar_load(const unsigned char* p)
+{
+    uint64_t w;
+    memcpy(&w,p,sizeof(uint64_t));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+static inline unsigned int swar_bits(uint64_t w)
+{
+    /* gather the high bit of each byte into an 8-bit mask */
+    return (unsigned int)(((w & SWAR_MSB) * 0x0002040810204081ULL) >> 56);
+}
+static inline unsigned int swar_match(uint64_t w,unsigned char b)
+{
+    /* this may report a false positive in a byte following a true match; that is
+       fine for key matches (the key is compared anyway) and cannot happen for
+       CTRL_EMPTY since no control byte has the value CTRL_EMPTY^1 */
+    uint64_t x = w ^ (SWAR_LSB * b);
+    return swar_bits((x - SWAR_LSB) & ~x);
+}
+static inline unsigned int group_match(const unsigned char* ctrl,unsigned char h2)
+{
+    return swar_match(swar_load(ctrl),h2) | swar_match(swar_load(ctrl+8),h2) << 8;
+}
+static inline unsigned int group_match_empty(const unsigned char* ctrl)
+{
+    return group_match(ctrl,CTRL_EMPTY);
+}
+static inline unsigned int group_match_free(const unsigned char* ctrl)
+{
+    return swar_bits(swar_load(ctrl)) | swar_bits(swar_load(ctrl+8)) << 8;
+}
+#endif
+
+static inline uint64_t flatmap_hash(struct flatmap* fm,const void* key)
+{
+    /* spread the user hash over 64 bits using the MurmurHash3 finalizer: the low 7
+       bits are stored in the control byte; the rest select the first group */
+    uint64_t h;
+    if (fm->fm_hash64 != NULL)
+        h = (*fm->fm_hash64)(key,fm->fm_seed);
+    else
+        h = (uint64_t)(unsigned int)(*fm->fm_hash)(key,INT_MAX);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+static int flatmap_find(struct flatmap* fm,const void* key,uint64_t hash)
+{
+    /* return the slot holding 'key' or -1; groups are probed in triangular order,
+       which visits every group since the group count is a power of two */
+    unsigned int g, gmask, step;
+    unsigned char h2;
+    gmask = fm->fm_capacity/GROUP_WIDTH - 1;
+    g = (unsigned int)(hash >> 7) & gmask;
+    h2 = hash & 0x7f;
+    step = 0;
+    while (1) {
+        unsigned int m;
+        const unsigned char* ctrl = fm->fm_ctrl + g*GROUP_WIDTH;
+        m = group_match(ctrl,h2);
+        while (m != 0) {
+            int slot = g*GROUP_WIDTH + __builtin_ctz(m);
+            if ((*fm->fm_compar)(fm->fm_slots[slot],key) == 0)
+                return slot;
+            m &= m-1;
+        }
+        /* the key would have been placed in this group if it existed */
+        if (group_match_empty(ctrl) != 0)
+            return -1;
+        g = (g + ++step) & gmask;
+    }
+}
+static int flatmap_find_free(struct flatmap* fm,uint64_t hash)
+{
+    /* return the first empty or deleted slot in the probe sequence of 'hash' */
+    unsigned int g, gmask, step;
+    gmask = fm->fm_capacity/GROUP_WIDTH - 1;
+    g = (unsigned int)(hash >> 7) & gmask;
+    step = 0;
+    while (1) {
+        unsigned int m;
+        m = group_match_free(fm->fm_ctrl + g*GROUP_WIDTH);
+        if (m != 0)
+            return g*GROUP_WIDTH + __builtin_ctz(m);
+        g = (g + ++step) & gmask;
+    }
+}
+static void flatmap_alloc(struct flatmap* fm,int capacity)
+{
+    /* the control bytes and slots share one allocation; 'capacity' is a multiple
+       of 16 so the slots stay aligned */
+    fm->fm_capacity = capacity;
+    fm->fm_ctrl = malloc(capacity + sizeof(void*) * capacity);
+    fm->fm_slots = (void**)(fm->fm_ctrl + capacity);
+    memset(fm->fm_ctrl,CTRL_EMPTY,capacity);
+    fm->fm_growth = capacity - capacity/8;
+}
+static void flatmap_rehash(struct flatmap* fm)
+{
+    /* rebuild the table; if most of the used slots are tombstones then keep the
+       same capacity, else double it */
+    int i, oldcap, slot;
+    unsigned char* oldctrl;
+    void** oldslots;
+    oldcap = fm->fm_capacity;
+    oldctrl = fm->fm_ctrl;
+    oldslots = fm->fm_slots;
+    flatmap_alloc(fm,fm->fm_count < oldcap/2 - oldcap/16 ? oldcap : oldcap*2);
+    for (i = 0;i < oldcap;++i) {
+        if ((oldctrl[i] & 0x80) == 0) {
+            slot = flatmap_find_free(fm,flatmap_hash(fm,oldslots[i]));
+            fm->fm_ctrl[slot] = oldctrl[i];
+            fm->fm_slots[slot] = oldslots[i];
+            --fm->fm_growth;
+        }
+    }
+    free(oldctrl);
+}
+
+struct flatmap* flatmap_new(int size,hash_function hash,key_comparator compar)
+{
+    struct flatmap* fm;
+    fm = malloc(sizeof(struct flatmap));
+    if (fm == NULL)
+        return NULL;
+    flatmap_init(fm,size,hash,compar);
+    return fm;
+}
+struct flatmap* flatmap_new_ex(int size,hash64_function hash,key_comparator compar)
+{
+    struct flatmap* fm;
+    fm = malloc(sizeof(struct flatmap));
+    if (fm == NULL)
+        return NULL;
+    flatmap_init_ex(fm,size,hash,compar);
+    return fm;
+}
+void flatmap_free(struct flatmap* fm)
+{
+    flatmap_delete(fm);
+    free(fm);
+}
+void flatmap_free_ex(struct flatmap* fm,destructor dstor)
+{
+    flatmap_delete_ex(fm,dstor);
+    free(fm);
+}
+void flatmap_init(struct flatmap* fm,int size,hash_function hash,key_comparator compar)
+{
+    /* 'size' is the number of keys the table should hold before it must grow */
+    int capacity;
+    capacity = FLATMAP_MIN_CAPACITY;
+    while (capacity - capacity/8 < size)
+        capacity <<= 1;
+    flatmap_alloc(fm,capacity);
+    fm->fm_count = 0;
+    fm->fm_hash = hash;
+    fm->fm_hash64 = NULL;
+    fm->fm_seed = 0;
+    fm->fm_compar = compar;
+}
+void flatmap_init_ex(struct flatmap* fm,int size,hash64_function hash,key_comparator compar)
+{
+    flatmap_init(fm,size,NULL,compar);
+    fm->fm_hash64 = hash;
+    fm->fm_seed = hash_random_seed();
+}
+void flatmap_delete(struct flatmap* fm)
+{
+    free(fm->fm_ctrl);
+    fm->fm_ctrl = NULL;
+    fm->fm_slots = NULL;
+    fm->fm_capacity = 0;
+    fm->fm_count = 0;
+    fm->fm_growth = 0;
+    fm->fm_hash = NULL;
+    fm->fm_hash64 = NULL;
+    fm->fm_compar = NULL;
+}
+void flatmap_delete_ex(struct flatmap* fm,destructor dstor)
+{
+    flatmap_reset_ex(fm,dstor);
+    flatmap_delete(fm);
+}
+void flatmap_reset(struct flatmap* fm)
+{
+    memset(fm->fm_ctrl,CTRL_EMPTY,fm->fm_capacity);
+    fm->fm_count = 0;
+    fm->fm_growth = fm->fm_capacity - fm->fm_capacity/8;
+}
+void flatmap_reset_ex(struct flatmap* fm,destructor dstor)
+{
+    int i;
+    for (i = 0;i < fm->fm_capacity;++i)
+        if ((fm->fm_ctrl[i] & 0x80) == 0)
+            (*dstor)(fm->fm_slots[i]);
+    flatmap_reset(fm);
+}
+int flatmap_insert(struct flatmap* fm,void* key)
+{
+    int slot;
+    uint64_t hash;
+    hash = flatmap_hash(fm,key);
+    if (flatmap_find(fm,key,hash) >= 0)
+        return 1;
+    slot = flatmap_find_free(fm,hash);
+    /* reusing a tombstone does not use up an empty slot */
+    if (fm->fm_ctrl[slot] == CTRL_EMPTY) {
+        if (fm->fm_growth == 0) {
+            flatmap_rehash(fm);
+            slot = flatmap_find_free(fm,hash);
+        }
+        --fm->fm_growth;
+    }
+    fm->fm_ctrl[slot] = hash & 0x7f;
+    fm->fm_slots[slot] = key;
+    ++fm->fm_count;
+    return 0;
+}
+void* flatmap_lookup(struct flatmap* fm,const void* key)
+{
+    int slot;
+    slot = flatmap_find(fm,key,flatmap_hash(fm,key));
+    if (slot < 0)
+        return NULL;
+    return fm->fm_slots[slot];
+}
+static void* flatmap_remove_generic(struct flatmap* fm,const void* key)
+{
+    int slot;
+    slot = flatmap_find(fm,key,flatmap_hash(fm,key));
+    if (slot < 0)
+        return NULL;
+    /* a probe stops at the first group with an empty slot; if this slot's group
+       already has one then no probe sequence continues past it and the slot can
+       become empty again; else it must become a tombstone */
+    if (group_match_empty(fm->fm_ctrl + (slot & ~(GROUP_WIDTH-1))) != 0) {
+        fm->fm_ctrl[slot] = CTRL_EMPTY;
+        ++fm->fm_growth;
+    }
+    else
+        fm->fm_ctrl[slot] = CTRL_DELETED;
+    --fm->fm_count;
+    return fm->fm_slots[slot];
+}
+int flatmap_remove(struct flatmap* fm,const void* key)
+{
+    if (flatmap_remove_generic(fm,key) == NULL)
+        return 1;
+    return 0;
+}
+int flatmap_remove_ex(struct flatmap* fm,const void* key,destructor dstor)
+{
+    void* result;
+    result = flatmap_remove_generic(fm,key);
+    if (result == NULL)
+        return 1;
+    (*dstor)(result);
+    return 0;
+}
@@ -0,0 +1,39 @@
+/* flatmap.h */
+#ifndef DSTRUCTS_FLATMAP_H
+#define DSTRUCTS_FLATMAP_H
+#include "hashmap.h"
+
+/* represents an open-addressing hash table that implements a map data structure;
+   it provides the same interface as 'struct hashmap' but stores the keys in a flat
+   array of slots alongside an array of one-byte control values (the slot state plus
+   7 bits of the key's hash); a probe examines a group of 16 control bytes at once so
+   that most misses never touch a key; a 'hash_function' is called with INT_MAX as the
+   size; the result of either kind of hash function is mixed before it is used */
+struct flatmap
+{
+    int fm_count;
+    int fm_capacity; /* number of slots; a power of two that is at least 16 */
+    int fm_growth; /* number of empty slots that may still be filled before the table is rebuilt */
+    unsigned char* fm_ctrl;
+    void** fm_slots;
+    hash_function fm_hash;
+    hash64_function fm_hash64;
+    uint64_t fm_seed;
+    key_comparator fm_compar;
+};
+struct flatmap* flatmap_new(int size,hash_function hash,key_comparator compar);
+struct flatmap* flatmap_new_ex(int size,hash64_function hash,key_comparator compar);
+void flatmap_free(struct flatmap* fm);
+void flatmap_free_ex(struct flatmap* fm,destructor dstor);
+void flatmap_init(struct flatmap* fm,int size,hash_function hash,key_comparator compar);
+void flatmap_init_ex(struct flatmap* fm,int size,hash64_function hash,key_comparator compar);
+void flatmap_delete(struct flatmap* fm);
+void flatmap_delete_ex(struct flatmap* fm,destructor dstor);
+void flatmap_reset(struct flatmap* fm);
+void flatmap_reset_ex(struct flatmap* fm,destructor dstor);
+int flatmap_insert(struct flatmap* fm,void* key);
+void* flatmap_lookup(struct flatmap* fm,const void* key);
+int flatmap_remove(struct flatmap* fm,const void* key);
+int flatmap_remove_ex(struct flatmap* fm,const void* key,destructor dstor);
+
+#endif
@@ -1,46 +1,407 @@
 /* hashmap.c */
 #include "hashmap.h"
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
-int hash_int(const int* key,int size)
+/* hash kernels: strings are hashed a word at a time using the wyhash algorithm
+   (public domain, Wang Yi); integers use the splitmix64 finalizer; both take
+   a seed so that a map's addresses cannot be predicted by its input */
+static const uint64_t wyp[4] = {
+    0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL,
+    0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+};
+static inline void wymum(uint64_t* a,uint64_t* b)
 {
-    int i = *key % size;
-    return i<0 ? -i : i;
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a>>32, hb = *b>>32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha*hb, rm0 = ha*lb, rm1 = hb*la, rl = la*lb, t = rl+(rm0<<32), c = t<rl, lo, hi;
+    lo = t+(rm1<<32);
+    c += lo<t;
+    hi = rh+(rm0>>32)+(rm1>>32)+c;
+    *a = lo;
+    *b = hi;
+#endif
 }
-
-int hash_string(const char* key,int size)
+static inline uint64_t wymix(uint64_t a,uint64_t b)
+{
+    wymum(&a,&b);
+    return a ^ b;
+}
+/* unaligned little-endian reads */
+static inline uint64_t wyr8(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v,p,8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+static inline uint64_t wyr4(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v,p,4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+static inline uint64_t wyr3(const unsigned char* p,size_t k)
+{
+    /* read 1-3 bytes */
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k>>1] << 8) | p[k-1];
+}
+uint64_t hash64_bytes(const void* key,size_t len,uint64_t seed)
 {
-    /* string hash using djb2 algorithm */
-    unsigned long hash = 5381;
-    while (*key) {
-        hash = ((hash<<5) + hash) + *key;
-        ++key;
+    const unsigned char* p = key;
+    uint64_t a, b;
+    seed ^= wymix(seed ^ wyp[0],wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len>>3)<<2));
+            b = (wyr4(p+len-4) << 32) | wyr4(p + len-4 - ((len>>3)<<2));
+        }
+        else if (len > 0) {
+            a = wyr3(p,len);
+            b = 0;
+        }
+        else
+            a = b = 0;
     }
-    return hash%size;
+    else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1],wyr8(p+8) ^ seed);
+                see1 = wymix(wyr8(p+16) ^ wyp[2],wyr8(p+24) ^ see1);
+                see2 = wymix(wyr8(p+32) ^ wyp[3],wyr8(p+40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ wyp[1],wyr8(p+8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        /* the tail is read as the last 16 bytes of the key (which may overlap) */
+        a = wyr8(p+i-16);
+        b = wyr8(p+i-8);
+    }
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a,&b);
+    return wymix(a ^ wyp[0] ^ len,b ^ wyp[1]);
+}
+uint64_t hash64_int(const int* key,uint64_t seed)
+{
+    uint64_t z;
+    z = (uint64_t)(int64_t)*key ^ seed;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+uint64_t hash64_string(const char* key,uint64_t seed)
+{
+    return hash64_bytes(key,strlen(key),seed);
+}
+uint64_t hash64_pstring(const char** key,uint64_t seed)
+{
+    return hash64_bytes(*key,strlen(*key),seed);
+}
+uint64_t hash_random_seed()
+{
+    /* there is no portable entropy source; mix the clock, a stack address (under
+       ASLR) and a counter so that maps created back to back get different seeds */
+    static uint64_t counter = 0;
+    uint64_t x;
+    x = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)(uintptr_t)&x;
+    x ^= __atomic_add_fetch(&counter,1,__ATOMIC_RELAXED) * 0x9e3779b97f4a7c15ULL;
+    return hash64_bytes(&x,sizeof(x),0x2d358dccaa6c78a5ULL);
 }
 
+/* the reduced hash functions use the same kernels with a fixed seed; the
+   full hash is mapped onto [0,size) with a multiply-shift instead of a modulo */
+static inline int hash_reduce(uint64_t hash,int size)
+{
+    return (int)(((hash >> 32) * (uint64_t)size) >> 32);
+}
+int hash_int(const int* key,int size)
+{
+    return hash_reduce(hash64_int(key,0),size);
+}
+int hash_string(const char* key,int size)
+{
+    return hash_reduce(hash64_string(key,0),size);
+}
 int hash_pstring(const char** key,int size)
 {
-    unsigned long hash = 5381;
-    const char* rkey = *key;
-    while (*rkey) {
-        hash = ((hash<<5) + hash) + *rkey;
-        ++rkey;
-    }
-    return hash%size;    
+    return hash_reduce(hash64_pstring(key,0),size);
 }
 
 struct hash_bucket
 {
     void* key;
+    uint64_t hash; /* full hash of 'key'; always zero if the map uses a 'hash_function' */
     struct hash_bucket* nxt;
 };
 static void hash_bucket_default(struct hash_bucket* hb)
 {
     hb->key = NULL;
+    hb->hash = 0;
     hb->nxt = NULL;
 }
 
+/* the table is grown (doubled) once the number of keys reaches its size; at
+   most HASHMAP_REHASH_STEP non-empty buckets (and HASHMAP_REHASH_STEP*10 empty
+   ones) are migrated per operation; since a doubled table takes 'hm_oldsize'
+   inserts to fill up again, the migration always finishes before the next grow */
+#define HASHMAP_DEFAULT_SIZE 16
+#define HASHMAP_REHASH_STEP 4
+
+/* number of keys that hashmap_lookup_batch keeps in flight */
+#define HASHMAP_BATCH_GROUP 16
+
+/* chain nodes are carved from slabs owned by the map; each new slab is twice as
+   large as the last (up to a limit) and nodes are handed out sequentially so that
+   nodes allocated together sit together; removed nodes go on a free list; a reset
+   keeps the slabs and just rewinds the allocation point to the first slab */
+#define HASH_SLAB_MIN 16
+#define HASH_SLAB_MAX 4096
+
+struct hash_slab
+{
+    struct hash_slab* next;
+    int size;
+    int used;
+    struct hash_bucket nodes[];
+};
+static struct hash_bucket* hashmap_node_alloc(struct hashmap* hm)
+{
+    struct hash_bucket* node;
+    struct hash_slab* slab;
+    if (hm->hm_free != NULL) {
+        node = hm->hm_free;
+        hm->hm_free = node->nxt;
+        return node;
+    }
+    slab = hm->hm_slab;
+    if (slab == NULL || slab->used >= slab->size) {
+        if (slab != NULL && slab->next != NULL)
+            /* reuse a slab that was kept by a reset */
+            slab = slab->next;
+        else {
+            struct hash_slab* nslab;
+            int size;
+            size = slab==NULL ? HASH_SLAB_MIN : slab->size*2;
+            if (size > HASH_SLAB_MAX)
+                size = HASH_SLAB_MAX;
+            nslab = malloc(sizeof(struct hash_slab) + sizeof(struct hash_bucket) * size);
+            nslab->next = NULL;
+            nslab->size = size;
+            if (slab == NULL)
+                hm->hm_slabs = nslab;
+            else
+                slab->next = nslab;
+            slab = nslab;
+        }
+        slab->used = 0;
+        hm->hm_slab = slab;
+    }
+    return slab->nodes + slab->used++;
+}
+static inline void hashmap_node_free(struct hashmap* hm,struct hash_bucket* node)
+{
+    node->nxt = hm->hm_free;
+    hm->hm_free = node;
+}
+static void hashmap_node_reset(struct hashmap* hm)
+{
+    /* release every chain node at once */
+    hm->hm_free = NULL;
+    hm->hm_slab = hm->hm_slabs;
+    if (hm->hm_slab != NULL)
+        hm->hm_slab->used = 0;
+}
+static void hashmap_node_delete(struct hashmap* hm)
+{
+    struct hash_slab* slab;
+    slab = hm->hm_slabs;
+    while (slab != NULL) {
+        struct hash_slab* tmp = slab->next;
+        free(slab);
+        slab = tmp;
+    }
+    hm->hm_slabs = NULL;
+    hm->hm_slab = NULL;
+    hm->hm_free = NULL;
+}
+
+static struct hash_bucket* hash_table_new(int size)
+{
+    /* an empty bucket is all zero (see hash_bucket_default), so the table is not
+       written here: a large block comes back as pages that the system zeroes
+       when they are first touched, which keeps the insert that grows the table
+       from paying for the whole new table at once */
+    return calloc(size,sizeof(struct hash_bucket));
+}
+static void hash_table_clear(struct hash_bucket* data,int size,destructor dstor)
+{
+    /* empty the table; call 'dstor' (if not NULL) on each key; the chain nodes are
+       not touched otherwise since they are released all at once with the slabs */
+    int i;
+    for (i = 0;i < size;++i) {
+        if (data[i].key != NULL) {
+            if (dstor != NULL) {
+                struct hash_bucket* hb;
+                (*dstor)(data[i].key);
+                for (hb = data[i].nxt;hb != NULL;hb = hb->nxt)
+                    (*dstor)(hb->key);
+            }
+            hash_bucket_default(data + i);
+        }
+    }
+}
+static void hash_table_traverse(struct hash_bucket* data,int size,key_callback callback,key_callback_ex callback_ex,void* cbdata)
+{
+    int i;
+    for (i = 0;i < size;++i) {
+        struct hash_bucket* hb;
+        if (data[i].key == NULL)
+            continue;
+        for (hb = data + i;hb != NULL;hb = hb->nxt) {
+            if (callback != NULL)
+                (*callback)(hb->key);
+            else
+                (*callback_ex)(hb->key,cbdata);
+        }
+    }
+}
+static inline uint64_t hashmap_hash(struct hashmap* hm,const void* key)
+{
+    if (hm->hm_hash64 != NULL)
+        return (*hm->hm_hash64)(key,hm->hm_seed);
+    return 0;
+}
+static inline int hashmap_index(struct hashmap* hm,const void* key,uint64_t hash,int size)
+{
+    if (hm->hm_hash64 != NULL)
+        return hash_reduce(hash,size);
+    return (*hm->hm_hash)(key,size);
+}
+static void hash_table_put(struct hashmap* hm,int index,void* key,uint64_t hash,struct hash_bucket* node)
+{
+    /* place 'key' in the bucket at 'index' without checking for duplicates; 'node' is
+       an unused chain node that may be used to store the key (or NULL if there is none);
+       the key is placed at the front of the chain */
+    struct hash_bucket* hb;
+    hb = hm->hm_data + index;
+    if (hb->key == NULL) {
+        hb->key = key;
+        hb->hash = hash;
+        if (node != NULL)
+            hashmap_node_free(hm,node);
+        return;
+    }
+    if (node == NULL)
+        node = hashmap_node_alloc(hm);
+    node->key = key;
+    node->hash = hash;
+    node->nxt = hb->nxt;
+    hb->nxt = node;
+}
+static void hashmap_rehash_bucket(struct hashmap* hm,int index)
+{
+    /* move the keys in bucket 'index' of the old table into the new table; the
+       chain nodes are recycled when possible */
+    struct hash_bucket* hb, *nxt;
+    hb = hm->hm_old + index;
+    if (hb->key == NULL)
+        return;
+    nxt = hb->nxt;
+    hash_table_put(hm,hashmap_index(hm,hb->key,hb->hash,hm->hm_size),hb->key,hb->hash,NULL);
+    while (nxt != NULL) {
+        struct hash_bucket* tmp = nxt->nxt;
+        hash_table_put(hm,hashmap_index(hm,nxt->key,nxt->hash,hm->hm_size),nxt->key,nxt->hash,nxt);
+        nxt = tmp;
+    }
+    hash_bucket_default(hb);
+}
+static void hashmap_rehash_finish(struct hashmap* hm)
+{
+    free(hm->hm_old);
+    hm->hm_old = NULL;
+    hm->hm_oldsize = 0;
+    hm->hm_rehash = 0;
+}
+static void hashmap_rehash_step(struct hashmap* hm)
+{
+    /* perform a bounded amount of migration work */
+    int moved, empty;
+    moved = 0;
+    empty = HASHMAP_REHASH_STEP * 10;
+    while (hm->hm_rehash < hm->hm_oldsize && moved < HASHMAP_REHASH_STEP) {
+        if (hm->hm_old[hm->hm_rehash].key != NULL) {
+            hashmap_rehash_bucket(hm,hm->hm_rehash);
+            ++moved;
+        }
+        else if (--empty <= 0) {
+            ++hm->hm_rehash;
+            break;
+        }
+        ++hm->hm_rehash;
+    }
+    if (hm->hm_rehash >= hm->hm_oldsize)
+        hashmap_rehash_finish(hm);
+}
+static void hashmap_grow(struct hashmap* hm)
+{
+    /* a rehash should never still be in progress here (see above) but finish it
+       just in case so that at most two tables exist at a time */
+    if (hm->hm_old != NULL) {
+        while (hm->hm_rehash < hm->hm_oldsize)
+            hashmap_rehash_bucket(hm,hm->hm_rehash++);
+        hashmap_rehash_finish(hm);
+    }
+    hm->hm_old = hm->hm_data;
+    hm->hm_oldsize = hm->hm_size;
+    hm->hm_rehash = 0;
+    hm->hm_size = hm->hm_size * 2;
+    hm->hm_data = hash_table_new(hm->hm_size);
+}
+static struct hash_bucket* hashmap_old_bucket(struct hashmap* hm,const void* key,uint64_t hash)
+{
+    /* return the bucket in the old table that may contain 'key' or NULL if the
+       bucket has already been migrated (or there is no old table) */
+    int index;
+    if (hm->hm_old == NULL)
+        return NULL;
+    index = hashmap_index(hm,key,hash,hm->hm_oldsize);
+    if (index < hm->hm_rehash)
+        return NULL;
+    return hm->hm_old + index;
+}
+static struct hash_bucket* hash_chain_find(struct hash_bucket* bucket,const void* key,uint64_t hash,key_comparator compar)
+{
+    if (bucket->key != NULL) {
+        while (1) {
+            if (bucket->hash == hash && (*compar)(bucket->key,key) == 0)
+                return bucket;
+            if (bucket->nxt == NULL)
+                break;
+            bucket = bucket->nxt;
+        }
+    }
+    return NULL;
+}
+
 struct hashmap* hashmap_new(int size,hash_function hash,key_comparator compar)
 {
     struct hashmap* hm;
@@ -50,6 +411,15 @@ struct hashmap* hashmap_new(int size,hash_function hash,key_comparator compar)
     hashmap_init(hm,size,hash,compar);
     return hm;
 }
+struct hashmap* hashmap_new_ex(int size,hash64_function hash,key_comparator compar)
+{
+    struct hashmap* hm;
+    hm = malloc(sizeof(struct hashmap));
+    if (hm == NULL)
+        return NULL;
+    hashmap_init_ex(hm,size,hash,compar);
+    return hm;
+}
 void hashmap_free(struct hashmap* hm)
 {
     hashmap_delete(hm);
@@ -62,155 +432,231 @@ void hashmap_free_ex(struct hashmap* hm,destructor dstor)
 }
 void hashmap_init(struct hashmap* hm,int size,hash_function hash,key_comparator compar)
 {
-    int i;
-    hm->hm_data = malloc(sizeof(struct hash_bucket) * size);
+    /* 'size' is only the initial size of the table */
+    if (size <= 0)
+        size = HASHMAP_DEFAULT_SIZE;
+    hm->hm_data = hash_table_new(size);
     hm->hm_size = size;
+    hm->hm_count = 0;
+    hm->hm_old = NULL;
+    hm->hm_oldsize = 0;
+    hm->hm_rehash = 0;
+    hm->hm_slabs = NULL;
+    hm->hm_slab = NULL;
+    hm->hm_free = NULL;
     hm->hm_hash = hash;
+    hm->hm_hash64 = NULL;
+    hm->hm_seed = 0;
     hm->hm_compar = compar;
-    for (i = 0;i < size;++i)
-        hash_bucket_default(hm->hm_data + i);
+}
+void hashmap_init_ex(struct hashmap* hm,int size,hash64_function hash,key_comparator compar)
+{
+    hashmap_init(hm,size,NULL,compar);
+    hm->hm_hash64 = hash;
+    hm->hm_seed = hash_random_seed();
 }
 void hashmap_delete(struct hashmap* hm)
 {
-    int i;
-    for (i = 0;i < hm->hm_size;++i) {
-        struct hash_bucket* hb;
-        hb = hm->hm_data[i].nxt;
-        while (hb != NULL) {
-            struct hash_bucket* tmp = hb->nxt;
-            free(hb);
-            hb = tmp;
-        }
-    }
-    hm->hm_size = 0;
-    free(hm->hm_data);
-    hm->hm_data = NULL;
-    hm->hm_hash = NULL;
-    hm->hm_compar = NULL;
+    hashmap_delete_ex(hm,NULL);
 }
 void hashmap_delete_ex(struct hashmap* hm,destructor dstor)
 {
-    int i;
-    for (i = 0;i < hm->hm_size;++i) {
-        if (hm->hm_data[i].key != NULL) {
-            struct hash_bucket* hb;
-            (*dstor)(hm->hm_data[i].key);
-            hb = hm->hm_data[i].nxt;
-            while (hb != NULL) {
-                struct hash_bucket* tmp = hb->nxt;
-                (*dstor)(hb->key);
-                free(hb);
-                hb = tmp;
-            }
-        }
+    if (dstor != NULL)
+        hash_table_clear(hm->hm_data,hm->hm_size,dstor);
+    if (hm->hm_old != NULL) {
+        if (dstor != NULL)
+            hash_table_clear(hm->hm_old,hm->hm_oldsize,dstor);
+        hashmap_rehash_finish(hm);
     }
+    hashmap_node_delete(hm);
     hm->hm_size = 0;
+    hm->hm_count = 0;
     free(hm->hm_data);
     hm->hm_data = NULL;
     hm->hm_hash = NULL;
+    hm->hm_hash64 = NULL;
     hm->hm_compar = NULL;
 }
 void hashmap_reset(struct hashmap* hm)
 {
-    int i;
-    for (i = 0;i < hm->hm_size;++i) {
-        if (hm->hm_data[i].key != NULL) {
-            struct hash_bucket* hb;
-            hb = hm->hm_data[i].nxt;
-            while (hb != NULL) {
-                struct hash_bucket* tmp = hb->nxt;
-                free(hb);
-                hb = tmp;
-            }
-            hash_bucket_default(hm->hm_data + i);
-        }
-    }
+    hashmap_reset_ex(hm,NULL);
 }
 void hashmap_reset_ex(struct hashmap* hm,destructor dstor)
 {
-    int i;
-    for (i = 0;i < hm->hm_size;++i) {
-        if (hm->hm_data[i].key != NULL) {
-            struct hash_bucket* hb;
-            (*dstor)(hm->hm_data[i].key);
-            hb = hm->hm_data[i].nxt;
-            while (hb != NULL) {
-                struct hash_bucket* tmp = hb->nxt;
-                (*dstor)(hb->key);
-                free(hb);
-                hb = tmp;
-            }
-            hash_bucket_default(hm->hm_data + i);
-        }
+    /* the table keeps its current (possibly grown) size */
+    hash_table_clear(hm->hm_data,hm->hm_size,dstor);
+    if (hm->hm_old != NULL) {
+        hash_table_clear(hm->hm_old,hm->hm_oldsize,dstor);
+        hashmap_rehash_finish(hm);
     }
+    hashmap_node_reset(hm);
+    hm->hm_count = 0;
 }
-int hashmap_insert(struct hashmap* hm,void* key)
+static struct hash_bucket* hashmap_probe(struct hashmap* hm,void* key,int insert,int* inserted)
 {
+    /* return the bucket holding 'key'; if it doesn't exist and 'insert' is non-zero
+       then add 'key' and return its new bucket, else return NULL; the key is hashed
+       and its chain walked only once */
     int index;
-    index = (*hm->hm_hash)(key,hm->hm_size);
-    if (hm->hm_data[index].key == NULL)
-        hm->hm_data[index].key = key;
-    else {
-        struct hash_bucket* last;
-        /* collision; insert the key at the end of the linked list of buckets */
-        last = hm->hm_data + index;
+    uint64_t hash;
+    struct hash_bucket* hb;
+    *inserted = 0;
+    hash = hashmap_hash(hm,key);
+    if (hm->hm_old != NULL)
+        hashmap_rehash_step(hm);
+    /* check the bucket of the old table if it has not been migrated yet */
+    hb = hashmap_old_bucket(hm,key,hash);
+    if (hb != NULL && (hb = hash_chain_find(hb,key,hash,hm->hm_compar)) != NULL)
+        return hb;
+    index = hashmap_index(hm,key,hash,hm->hm_size);
+    hb = hm->hm_data + index;
+    if (hb->key != NULL) {
         while (1) {
-            /* make sure that the key doesn't already exist in the map */
-            if ((*hm->hm_compar)(last->key,key) == 0)
-                return 1;
-            if (last->nxt == NULL)
+            if (hb->hash == hash && (*hm->hm_compar)(hb->key,key) == 0)
+                return hb;
+            if (hb->nxt == NULL)
                 break;
-            last = last->nxt;
+            hb = hb->nxt;
         }
-        last->nxt = malloc(sizeof(struct hash_bucket));
-        last->nxt->key = key;
-        last->nxt->nxt = NULL;
+        if (!insert)
+            return NULL;
+        /* collision; insert the key at the end of the linked list of buckets */
+        hb->nxt = hashmap_node_alloc(hm);
+        hb = hb->nxt;
+        hb->nxt = NULL;
     }
-    return 0;
+    else if (!insert)
+        return NULL;
+    hb->key = key;
+    hb->hash = hash;
+    *inserted = 1;
+    /* growing the table leaves 'hb' in place until it is migrated */
+    if (++hm->hm_count >= hm->hm_size)
+        hashmap_grow(hm);
+    return hb;
+}
+int hashmap_insert(struct hashmap* hm,void* key)
+{
+    int inserted;
+    hashmap_probe(hm,key,1,&inserted);
+    return inserted ? 0 : 1;
+}
+void** hashmap_find_or_insert(struct hashmap* hm,void* key,int* inserted)
+{
+    /* return the slot that holds the key equal to 'key'; if there was none then
+       'key' itself is inserted and '*inserted' is set; the caller may then store a
+       different key in the slot as long as it compares and hashes the same (for
+       example a heap copy of a stack key); the slot is only valid until the next
+       operation on the map */
+    return &hashmap_probe(hm,key,1,inserted)->key;
+}
+void* hashmap_replace(struct hashmap* hm,void* key)
+{
+    /* replace the key equal to 'key' with 'key' itself and return the key that
+       was replaced, or NULL if there was none (in which case nothing is inserted) */
+    int inserted;
+    void* old;
+    struct hash_bucket* hb;
+    hb = hashmap_probe(hm,key,0,&inserted);
+    if (hb == NULL)
+        return NULL;
+    old = hb->key;
+    hb->key = key;
+    return old;
 }
 void* hashmap_lookup(struct hashmap* hm,const void* key)
 {
     int index;
-    index = (*hm->hm_hash)(key,hm->hm_size);
-    if (hm->hm_data[index].key != NULL) {
-        struct hash_bucket* bucket;
-        bucket = &hm->hm_data[index];
-        while (1) {
-            if ((*hm->hm_compar)(bucket->key,key) == 0)
-                return bucket->key;
-            if (bucket->nxt == NULL)
-                break;
-            bucket = bucket->nxt;
-        }
+    uint64_t hash;
+    struct hash_bucket* bucket;
+    hash = hashmap_hash(hm,key);
+    if (hm->hm_old != NULL) {
+        hashmap_rehash_step(hm);
+        bucket = hashmap_old_bucket(hm,key,hash);
+        if (bucket != NULL && (bucket = hash_chain_find(bucket,key,hash,hm->hm_compar)) != NULL)
+            return bucket->key;
     }
+    index = hashmap_index(hm,key,hash,hm->hm_size);
+    bucket = hash_chain_find(hm->hm_data + index,key,hash,hm->hm_compar);
+    if (bucket != NULL)
+        return bucket->key;
     return NULL;
 }
-static void* hashmap_remove_generic(struct hashmap* hm,const void* key)
+void hashmap_lookup_batch(struct hashmap* hm,void** keys,int n,void** results)
 {
-    int index;
-    index = (*hm->hm_hash)(key,hm->hm_size);
-    if (hm->hm_data[index].key != NULL) {
+    /* look up 'n' keys at once, storing each result (or NULL) in 'results'; keys
+       are processed in groups: first every key in the group is hashed and its
+       bucket prefetched, then all the chains are walked in lock step so that the
+       next node of every chain is prefetched while the others are examined */
+    int i, j, m, pending;
+    uint64_t hashes[HASHMAP_BATCH_GROUP];
+    struct hash_bucket* cur[HASHMAP_BATCH_GROUP];
+    if (hm->hm_old != NULL)
+        hashmap_rehash_step(hm);
+    for (i = 0;i < n;i += HASHMAP_BATCH_GROUP) {
+        m = n-i < HASHMAP_BATCH_GROUP ? n-i : HASHMAP_BATCH_GROUP;
+        for (j = 0;j < m;++j) {
+            const void* key = keys[i+j];
+            struct hash_bucket* old;
+            results[i+j] = NULL;
+            hashes[j] = hashmap_hash(hm,key);
+            old = hashmap_old_bucket(hm,key,hashes[j]);
+            if (old != NULL && (old = hash_chain_find(old,key,hashes[j],hm->hm_compar)) != NULL) {
+                /* found in the part of the old table that is not yet migrated */
+                results[i+j] = old->key;
+                cur[j] = NULL;
+                continue;
+            }
+            cur[j] = hm->hm_data + hashmap_index(hm,key,hashes[j],hm->hm_size);
+            __builtin_prefetch(cur[j]);
+        }
+        do {
+            pending = 0;
+            for (j = 0;j < m;++j) {
+                struct hash_bucket* hb = cur[j];
+                if (hb == NULL)
+                    continue;
+                /* only a table bucket can be empty; chain nodes always hold a key */
+                if (hb->key == NULL)
+                    cur[j] = NULL;
+                else if (hb->hash == hashes[j] && (*hm->hm_compar)(hb->key,keys[i+j]) == 0) {
+                    results[i+j] = hb->key;
+                    cur[j] = NULL;
+                }
+                else if ((cur[j] = hb->nxt) != NULL) {
+                    __builtin_prefetch(cur[j]);
+                    ++pending;
+                }
+            }
+        } while (pending > 0);
+    }
+}
+static void* hash_chain_remove(struct hashmap* hm,struct hash_bucket* head,const void* key,uint64_t hash)
+{
+    key_comparator compar = hm->hm_compar;
+    if (head->key != NULL) {
         void* r;
         struct hash_bucket* del, *prev;
-        if ((*hm->hm_compar)(hm->hm_data[index].key,key) == 0) {
-            r = hm->hm_data[index].key;
-            if (hm->hm_data[index].nxt != NULL) {
-                del = hm->hm_data[index].nxt;
-                hm->hm_data[index].key = del->key;
-                hm->hm_data[index].nxt = del->nxt;
-                free(del);
+        if (head->hash == hash && (*compar)(head->key,key) == 0) {
+            r = head->key;
+            if (head->nxt != NULL) {
+                del = head->nxt;
+                head->key = del->key;
+                head->hash = del->hash;
+                head->nxt = del->nxt;
+                hashmap_node_free(hm,del);
             }
             else
-                hm->hm_data[index].key = NULL;
+                head->key = NULL;
             return r;
         }
-        prev = hm->hm_data + index;
+        prev = head;
         del = prev->nxt;
         while (del != NULL) {
-            if ((*hm->hm_compar)(del->key,key) == 0) {
+            if (del->hash == hash && (*compar)(del->key,key) == 0) {
                 r = del->key;
                 prev->nxt = del->nxt;
-                free(del);
+                hashmap_node_free(hm,del);
                 return r;
             }
             prev = del;
@@ -219,6 +665,25 @@ static void* hashmap_remove_generic(struct hashmap* hm,const void* key)
     }
     return NULL;
 }
+static void* hashmap_remove_generic(struct hashmap* hm,const void* key)
+{
+    void* r;
+    uint64_t hash;
+    struct hash_bucket* old;
+    r = NULL;
+    hash = hashmap_hash(hm,key);
+    if (hm->hm_old != NULL) {
+        hashmap_rehash_step(hm);
+        old = hashmap_old_bucket(hm,key,hash);
+        if (old != NULL)
+            r = hash_chain_remove(hm,old,key,hash);
+    }
+    if (r == NULL)
+        r = hash_chain_remove(hm,hm->hm_data + hashmap_index(hm,key,hash,hm->hm_size),key,hash);
+    if (r != NULL)
+        --hm->hm_count;
+    return r;
+}
 int hashmap_remove(struct hashmap* hm,const void* key)
 {
     void* result;
@@ -236,3 +701,17 @@ int hashmap_remove_ex(struct hashmap* hm,const void* key,destructor dstor)
     (*dstor)(result);
     return 0;    
 }
+void hashmap_traversal(struct hashmap* hm,key_callback callback)
+{
+    /* visit every key in no particular order; the map must not be modified by
+       the callback */
+    hash_table_traverse(hm->hm_data,hm->hm_size,callback,NULL,NULL);
+    if (hm->hm_old != NULL)
+        hash_table_traverse(hm->hm_old,hm->hm_oldsize,callback,NULL,NULL);
+}
+void hashmap_traversal_ex(struct hashmap* hm,key_callback_ex callback,void* data)
+{
+    hash_table_traverse(hm->hm_data,hm->hm_size,NULL,callback,data);
+    if (hm->hm_old != NULL)
+        hash_table_traverse(hm->hm_old,hm->hm_oldsize,NULL,callback,data);
+}
@@ -2,37 +2,73 @@
 #ifndef DSTRUCTS_HASHMAP_H
 #define DSTRUCTS_HASHMAP_H
 #include "dstructs.h"
+#include <stddef.h>
+#include <stdint.h>
 
-/* typedefs for function types used by the hashmap */
+/* typedefs for function types used by the hashmap; a 'hash_function' reduces the
+   hash to an address in [0,size) itself; a 'hash64_function' returns the full-width
+   hash, which the table keeps alongside the key */
 typedef int (*hash_function)(const void* key,int size);
+typedef uint64_t (*hash64_function)(const void* key,uint64_t seed);
 
-/* hash functions for common key types */
+/* hash functions for common key types; the 64-bit versions take a seed that
+   the map chooses at random when it is initialized */
 int hash_int(const int* key,int size);
 int hash_string(const char* key,int size);
 int hash_pstring(const char** key,int size);
+uint64_t hash64_int(const int* key,uint64_t seed);
+uint64_t hash64_string(const char* key,uint64_t seed);
+uint64_t hash64_pstring(const char** key,uint64_t seed);
+uint64_t hash64_bytes(const void* key,size_t len,uint64_t seed);
+uint64_t hash_random_seed();
 
 struct hash_bucket;
+struct hash_slab;
 
-/* represents a fixed-sized hash table that implements a map data structure; a
-   user supplied hash-function generates an address for the key domain */
+/* represents a hash table that implements a map data structure; a user supplied
+   hash-function generates an address for the key domain; the table grows when
+   its load factor is exceeded: the keys are migrated to the larger table a few
+   buckets at a time by each subsequent operation, so no single call pays for the
+   whole rehash; if the map is created with a 'hash64_function' then each bucket
+   caches its key's hash: chain entries with a different hash are skipped without
+   calling the comparator and the rehash never calls the hash function again */
 struct hashmap
 {
     int hm_size;
+    int hm_count;
     struct hash_bucket* hm_data;
+    /* old table that is being migrated into 'hm_data'; buckets below 'hm_rehash'
+       have already been moved; 'hm_old' is NULL when no rehash is in progress */
+    int hm_oldsize;
+    int hm_rehash;
+    struct hash_bucket* hm_old;
+    /* chain nodes are allocated from slabs owned by the map */
+    struct hash_slab* hm_slabs;
+    struct hash_slab* hm_slab;
+    struct hash_bucket* hm_free;
     hash_function hm_hash;
+    hash64_function hm_hash64;
+    uint64_t hm_seed;
     key_comparator hm_compar;
 };
 struct hashmap* hashmap_new(int size,hash_function hash,key_comparator compar);
+struct hashmap* hashmap_new_ex(int size,hash64_function hash,key_comparator compar);
 void hashmap_free(struct hashmap* hm);
 void hashmap_free_ex(struct hashmap* hm,destructor dstor);
 void hashmap_init(struct hashmap* hm,int size,hash_function hash,key_comparator compar);
+void hashmap_init_ex(struct hashmap* hm,int size,hash64_function hash,key_comparator compar);
 void hashmap_delete(struct hashmap* hm);
 void hashmap_delete_ex(struct hashmap* hm,destructor dstor);
 void hashmap_reset(struct hashmap* hm);
 void hashmap_reset_ex(struct hashmap* hm,destructor dstor);
 int hashmap_insert(struct hashmap* hm,void* key);
+void** hashmap_find_or_insert(struct hashmap* hm,void* key,int* inserted);
+void* hashmap_replace(struct hashmap* hm,void* key);
 void* hashmap_lookup(struct hashmap* hm,const void* key);
+void hashmap_lookup_batch(struct hashmap* hm,void** keys,int n,void** results);
 int hashmap_remove(struct hashmap* hm,const void* key);
 int hashmap_remove_ex(struct hashmap* hm,const void* key,destructor dstor);
+void hashmap_traversal(struct hashmap* hm,key_callback callback);
+void hashmap_traversal_ex(struct hashmap* hm,key_callback_ex callback,void* data);
 
 #endif
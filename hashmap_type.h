@@ -0,0 +1,268 @@
+/* hashmap_type.h - generates a hash map specialized for a key type; like
+   treemap_type.h this header is included once for each map type, after
+   defining:
+
+     HASHMAP_TYPE_NAME       name of the map type; the generated structure is
+                             'struct NAME' and its functions are 'NAME_insert'
+                             and so on
+     HASHMAP_TYPE_KEY        key type (such as 'int' or 'uint64_t')
+     HASHMAP_TYPE_VALUE      value type
+     HASHMAP_TYPE_HASH       (optional) 'HASHMAP_TYPE_HASH(k)' returns a
+                             well-mixed uint64_t hash of key 'k'; by default the
+                             key is converted to uint64_t and mixed with the
+                             splitmix64 finalizer, which suits integer and
+                             pointer keys
+     HASHMAP_TYPE_EQUAL      (optional) 'HASHMAP_TYPE_EQUAL(a,b)' is non-zero if
+                             keys 'a' and 'b' are equal (default '==')
+
+   the map stores keys and values inline in one open-addressed table that is
+   probed linearly; a parallel array holds one control byte per slot (zero if
+   the slot is empty, otherwise seven bits of the key's hash) so that most
+   occupied slots with a different key are skipped without loading the key;
+   removal shifts the following entries back instead of leaving tombstones; the
+   parameters are undefined again at the end of this header */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef HASHMAP_TYPE_NAME
+#error "HASHMAP_TYPE_NAME must be defined before including hashmap_type.h"
+#endif
+#ifndef HASHMAP_TYPE_KEY
+#error "HASHMAP_TYPE_KEY must be defined before including hashmap_type.h"
+#endif
+#ifndef HASHMAP_TYPE_VALUE
+#error "HASHMAP_TYPE_VALUE must be defined before including hashmap_type.h"
+#endif
+#ifndef HASHMAP_TYPE_HASH
+#define HASHMAP_TYPE_HASH(k) hashmap_type_mix((uint64_t)(k))
+#endif
+#ifndef HASHMAP_TYPE_EQUAL
+#define HASHMAP_TYPE_EQUAL(a,b) ((a) == (b))
+#endif
+
+#ifndef DSTRUCTS_HASHMAP_TYPE_H
+#define DSTRUCTS_HASHMAP_TYPE_H
+#define HASHMAP_TYPE_CAT2(a,b) a##_##b
+#define HASHMAP_TYPE_CAT(a,b) HASHMAP_TYPE_CAT2(a,b)
+#define HASHMAP_TYPE_MIN_SIZE 16
+static inline uint64_t hashmap_type_mix(uint64_t x)
+{
+    /* splitmix64 finalizer */
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+#endif
+
+/* shorthands used by the generated code */
+#define HT_(x) HASHMAP_TYPE_CAT(HASHMAP_TYPE_NAME,x)
+#define HT_KEY HASHMAP_TYPE_KEY
+#define HT_VALUE HASHMAP_TYPE_VALUE
+#define HT_ENTRY struct HT_(entry)
+/* the slot comes from the low bits of the hash and the tag from the high bits */
+#define HT_TAG(h) ((unsigned char)(0x80 | ((h) >> 57)))
+
+struct HT_(entry)
+{
+    HT_KEY key;
+    HT_VALUE value;
+};
+struct HASHMAP_TYPE_NAME
+{
+    int count;
+    int size; /* power of two, or zero before the first insert */
+    unsigned char* ctrl;
+    HT_ENTRY* entries;
+};
+
+static inline void HT_(init)(struct HASHMAP_TYPE_NAME* map)
+{
+    map->count = 0;
+    map->size = 0;
+    map->ctrl = NULL;
+    map->entries = NULL;
+}
+static inline void HT_(delete)(struct HASHMAP_TYPE_NAME* map)
+{
+    free(map->ctrl);
+    free(map->entries);
+    HT_(init)(map);
+}
+static inline struct HASHMAP_TYPE_NAME* HT_(new)()
+{
+    struct HASHMAP_TYPE_NAME* map;
+    map = malloc(sizeof(struct HASHMAP_TYPE_NAME));
+    if (map == NULL)
+        return NULL;
+    HT_(init)(map);
+    return map;
+}
+static inline void HT_(free)(struct HASHMAP_TYPE_NAME* map)
+{
+    if (map != NULL) {
+        HT_(delete)(map);
+        free(map);
+    }
+}
+static inline int HT_(probe)(struct HASHMAP_TYPE_NAME* map,HT_KEY key,uint64_t hash,int* found)
+{
+    /* return the slot that holds 'key' (setting '*found') or else the empty slot
+       that ends its probe sequence; the table always has an empty slot */
+    int i, mask;
+    unsigned char tag;
+    mask = map->size - 1;
+    tag = HT_TAG(hash);
+    i = (int)(hash & mask);
+    while (map->ctrl[i] != 0) {
+        if (map->ctrl[i] == tag && HASHMAP_TYPE_EQUAL(map->entries[i].key,key)) {
+            *found = 1;
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    *found = 0;
+    return i;
+}
+static inline int HT_(reserve)(struct HASHMAP_TYPE_NAME* map,int count)
+{
+    /* make room for 'count' keys without exceeding a load factor of 7/8; return
+       non-zero if the table could not be allocated */
+    int i, size, oldsize;
+    unsigned char* ctrl, *oldctrl;
+    HT_ENTRY* entries, *oldentries;
+    size = map->size > 0 ? map->size : HASHMAP_TYPE_MIN_SIZE;
+    while (count > size - size/8)
+        size *= 2;
+    if (size == map->size)
+        return 0;
+    ctrl = calloc(size,1);
+    entries = malloc(sizeof(HT_ENTRY) * size);
+    if (ctrl == NULL || entries == NULL) {
+        free(ctrl);
+        free(entries);
+        return 1;
+    }
+    oldsize = map->size;
+    oldctrl = map->ctrl;
+    oldentries = map->entries;
+    map->size = size;
+    map->ctrl = ctrl;
+    map->entries = entries;
+    for (i = 0;i < oldsize;++i) {
+        if (oldctrl[i] != 0) {
+            int j, found;
+            uint64_t hash = HASHMAP_TYPE_HASH(oldentries[i].key);
+            j = HT_(probe)(map,oldentries[i].key,hash,&found);
+            ctrl[j] = oldctrl[i];
+            entries[j] = oldentries[i];
+        }
+    }
+    free(oldctrl);
+    free(oldentries);
+    return 0;
+}
+static inline HT_VALUE* HT_(find_or_insert)(struct HASHMAP_TYPE_NAME* map,HT_KEY key,int* inserted)
+{
+    /* return the value stored with 'key'; if there was none then 'key' is
+       inserted (with an unset value that the caller should assign) and
+       '*inserted' is set; NULL is returned if the table could not grow; the
+       pointer is only valid until the map is next modified */
+    int i, found, size;
+    uint64_t hash;
+    *inserted = 0;
+    i = 0;
+    hash = HASHMAP_TYPE_HASH(key);
+    /* look for the key first so that finding it never grows the table */
+    size = map->size;
+    if (size > 0) {
+        i = HT_(probe)(map,key,hash,&found);
+        if (found)
+            return &map->entries[i].value;
+    }
+    if (HT_(reserve)(map,map->count+1) != 0)
+        return NULL;
+    if (map->size != size) /* always true for an empty table */
+        i = HT_(probe)(map,key,hash,&found);
+    map->ctrl[i] = HT_TAG(hash);
+    map->entries[i].key = key;
+    ++map->count;
+    *inserted = 1;
+    return &map->entries[i].value;
+}
+static inline int HT_(insert)(struct HASHMAP_TYPE_NAME* map,HT_KEY key,HT_VALUE value)
+{
+    /* insert 'key' with 'value' and return zero, or return non-zero (leaving the
+       map unchanged) if 'key' is already present or the table could not grow */
+    int inserted;
+    HT_VALUE* slot;
+    slot = HT_(find_or_insert)(map,key,&inserted);
+    if (!inserted)
+        return 1;
+    *slot = value;
+    return 0;
+}
+static inline HT_VALUE* HT_(lookup)(struct HASHMAP_TYPE_NAME* map,HT_KEY key)
+{
+    /* return the value stored with 'key' or NULL if 'key' is not present */
+    int i, found;
+    if (map->count == 0)
+        return NULL;
+    i = HT_(probe)(map,key,HASHMAP_TYPE_HASH(key),&found);
+    return found ? &map->entries[i].value : NULL;
+}
+static inline int HT_(remove)(struct HASHMAP_TYPE_NAME* map,HT_KEY key,HT_VALUE* value)
+{
+    /* remove 'key' and store its value in '*value' (if 'value' is not NULL);
+       return non-zero if 'key' was not present */
+    int i, j, mask, found;
+    if (map->count == 0)
+        return 1;
+    i = HT_(probe)(map,key,HASHMAP_TYPE_HASH(key),&found);
+    if (!found)
+        return 1;
+    if (value != NULL)
+        *value = map->entries[i].value;
+    /* shift back each following entry whose home slot does not lie between the
+       hole and the entry, so that no probe sequence crosses an empty slot */
+    mask = map->size - 1;
+    j = i;
+    while (1) {
+        int home;
+        j = (j + 1) & mask;
+        if (map->ctrl[j] == 0)
+            break;
+        home = (int)(HASHMAP_TYPE_HASH(map->entries[j].key) & mask);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            map->ctrl[i] = map->ctrl[j];
+            map->entries[i] = map->entries[j];
+            i = j;
+        }
+    }
+    map->ctrl[i] = 0;
+    --map->count;
+    return 0;
+}
+static inline void HT_(traversal)(struct HASHMAP_TYPE_NAME* map,void (*callback)(HT_KEY,HT_VALUE*,void*),void* data)
+{
+    /* call 'callback' with each key, a pointer to its value and 'data' in no
+       particular order */
+    int i;
+    for (i = 0;i < map->size;++i)
+        if (map->ctrl[i] != 0)
+            (*callback)(map->entries[i].key,&map->entries[i].value,data);
+}
+
+#undef HT_
+#undef HT_KEY
+#undef HT_VALUE
+#undef HT_ENTRY
+#undef HT_TAG
+#undef HASHMAP_TYPE_NAME
+#undef HASHMAP_TYPE_KEY
+#undef HASHMAP_TYPE_VALUE
+#undef HASHMAP_TYPE_HASH
+#undef HASHMAP_TYPE_EQUAL
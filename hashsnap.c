@@ -0,0 +1,288 @@
+/* hashsnap.c - implements memory mapped hash table snapshots */
+#include "hashsnap.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* file layout: a header, the bucket array, the entry array and then the key and
+   payload bytes; every section starts on an 8 byte boundary; the entries are
+   grouped by bucket and bucket 'b' owns entries [buckets[b],buckets[b+1]); an
+   entry's key is found at its offset within the data section and its payload
+   follows the key (padded to 8 bytes) */
+#define HASHSNAP_MAGIC "DSHSNAP\0"
+#define HASHSNAP_VERSION 1
+#define HASHSNAP_BYTEORDER 0x01020304
+
+struct hashsnap_header
+{
+    char magic[8];
+    uint32_t byteorder;
+    uint32_t version;
+    uint64_t seed;
+    uint64_t count;
+    uint64_t nbuckets;
+    uint64_t buckets; /* file offsets of the sections */
+    uint64_t entries;
+    uint64_t data;
+    uint64_t size; /* size of the whole file */
+};
+struct hashsnap_entry
+{
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t keylen;
+    uint32_t vallen;
+};
+
+static inline uint64_t hashsnap_align(uint64_t n)
+{
+    return (n + 7) & ~(uint64_t)7;
+}
+static inline uint32_t hashsnap_bucket(uint64_t hash,uint32_t nbuckets)
+{
+    return (uint32_t)(((hash >> 32) * nbuckets) >> 32);
+}
+
+/* writer */
+struct hashsnap_builder
+{
+    int count;
+    int error;
+    hashsnap_encoder encode;
+    struct hashsnap_record* records;
+};
+static void hashsnap_collect(void* key,void* data)
+{
+    struct hashsnap_builder* b = data;
+    struct hashsnap_record* r = b->records + b->count++;
+    r->value = NULL;
+    r->vallen = 0;
+    (*b->encode)(key,r);
+    if (r->keylen > UINT32_MAX || r->vallen > UINT32_MAX)
+        b->error = 1;
+}
+static int hashsnap_pad(FILE* f,uint64_t n)
+{
+    static const char zero[8];
+    n = hashsnap_align(n) - n;
+    return n == 0 || fwrite(zero,1,n,f) == n;
+}
+static int hashsnap_write_file(FILE* f,struct hashsnap_builder* b)
+{
+    /* lay out and write the snapshot for the collected records */
+    int i, ok;
+    uint32_t* buckets;
+    struct hashsnap_entry* entries;
+    struct hashsnap_header header;
+    uint64_t* hashes, offset;
+    memset(&header,0,sizeof(struct hashsnap_header));
+    memcpy(header.magic,HASHSNAP_MAGIC,8);
+    header.byteorder = HASHSNAP_BYTEORDER;
+    header.version = HASHSNAP_VERSION;
+    header.seed = hash_random_seed();
+    header.count = b->count;
+    header.nbuckets = b->count > 0 ? b->count : 1;
+    buckets = calloc(header.nbuckets+1,sizeof(uint32_t));
+    entries = malloc(sizeof(struct hashsnap_entry) * (b->count + 1));
+    hashes = malloc(sizeof(uint64_t) * (b->count + 1));
+    /* sort the records by bucket (counting sort) */
+    for (i = 0;i < b->count;++i) {
+        hashes[i] = hash64_bytes(b->records[i].key,b->records[i].keylen,header.seed);
+        ++buckets[hashsnap_bucket(hashes[i],header.nbuckets)+1];
+    }
+    for (i = 0;i < (int)header.nbuckets;++i)
+        buckets[i+1] += buckets[i];
+    offset = 0;
+    for (i = 0;i < b->count;++i) {
+        uint32_t bucket = hashsnap_bucket(hashes[i],header.nbuckets);
+        struct hashsnap_entry* e = entries + buckets[bucket]++;
+        e->hash = hashes[i];
+        e->offset = offset;
+        e->keylen = b->records[i].keylen;
+        e->vallen = b->records[i].vallen;
+        offset += hashsnap_align(e->keylen) + hashsnap_align(e->vallen);
+    }
+    /* each 'buckets[b]' now holds the end of bucket 'b'; shift them back */
+    memmove(buckets+1,buckets,sizeof(uint32_t) * header.nbuckets);
+    buckets[0] = 0;
+    header.buckets = hashsnap_align(sizeof(struct hashsnap_header));
+    header.entries = header.buckets + hashsnap_align(sizeof(uint32_t) * (header.nbuckets+1));
+    header.data = header.entries + sizeof(struct hashsnap_entry) * b->count;
+    header.size = header.data + offset;
+    ok = fwrite(&header,sizeof(struct hashsnap_header),1,f) == 1
+        && hashsnap_pad(f,sizeof(struct hashsnap_header))
+        && fwrite(buckets,sizeof(uint32_t),header.nbuckets+1,f) == header.nbuckets+1
+        && hashsnap_pad(f,sizeof(uint32_t) * (header.nbuckets+1))
+        && fwrite(entries,sizeof(struct hashsnap_entry),b->count,f) == (size_t)b->count;
+    /* the data is written in the original record order, which is the order the
+       offsets were assigned in */
+    for (i = 0;i < b->count && ok;++i) {
+        struct hashsnap_record* r = b->records + i;
+        ok = fwrite(r->key,1,r->keylen,f) == r->keylen
+            && hashsnap_pad(f,r->keylen)
+            && (r->vallen == 0 || fwrite(r->value,1,r->vallen,f) == r->vallen)
+            && hashsnap_pad(f,r->vallen);
+    }
+    free(buckets);
+    free(entries);
+    free(hashes);
+    return ok;
+}
+int hashsnap_write(struct hashmap* hm,const char* path,hashsnap_encoder encode)
+{
+    /* write the keys of 'hm' to a snapshot at 'path'; the file is written under a
+       unique temporary name in the same directory, flushed to disk and then
+       renamed, so processes that have the old snapshot mapped are not disturbed,
+       concurrent writers do not share a temporary file and a crash leaves either
+       the old or the new snapshot in place; return 0 on success or 1 if the file
+       could not be written (errno describes the error) */
+    int ok, fd;
+    char* tmppath;
+    FILE* f;
+    struct hashsnap_builder builder;
+    builder.count = 0;
+    builder.error = 0;
+    builder.encode = encode;
+    builder.records = malloc(sizeof(struct hashsnap_record) * (hm->hm_count + 1));
+    hashmap_traversal_ex(hm,hashsnap_collect,&builder);
+    tmppath = malloc(strlen(path) + 8);
+    strcpy(tmppath,path);
+    strcat(tmppath,".XXXXXX");
+    ok = 0;
+    if (!builder.error && (fd = mkstemp(tmppath)) != -1) {
+        /* mkstemp creates the file readable by its owner only */
+        fchmod(fd,0644);
+        if ((f = fdopen(fd,"wb")) != NULL) {
+            ok = hashsnap_write_file(f,&builder) && fflush(f) == 0 && fsync(fileno(f)) == 0;
+            if (fclose(f) != 0)
+                ok = 0;
+        }
+        else
+            close(fd);
+        if (ok)
+            ok = rename(tmppath,path) == 0;
+        if (!ok)
+            remove(tmppath);
+    }
+    free(tmppath);
+    free(builder.records);
+    return !ok;
+}
+
+/* reader */
+struct hashsnap* hashsnap_new(const char* path)
+{
+    struct hashsnap* hs;
+    hs = malloc(sizeof(struct hashsnap));
+    if (hs == NULL)
+        return NULL;
+    if (hashsnap_init(hs,path) != 0) {
+        free(hs);
+        return NULL;
+    }
+    return hs;
+}
+void hashsnap_free(struct hashsnap* hs)
+{
+    if (hs != NULL) {
+        hashsnap_delete(hs);
+        free(hs);
+    }
+}
+static int hashsnap_check_sections(const struct hashsnap_header* header)
+{
+    /* the offsets come from the file and cannot be trusted: check that the
+       sections follow the header in order, are aligned and lie within the file,
+       and that each is long enough for its contents; lengths are compared by
+       subtracting offsets (which are then known to be in order) so that nothing
+       can wrap around */
+    if (header->buckets < sizeof(struct hashsnap_header) || header->buckets > header->entries
+        || header->entries > header->data || header->data > header->size)
+        return 0;
+    if (header->buckets % sizeof(uint32_t) != 0 || header->entries % sizeof(uint64_t) != 0)
+        return 0;
+    if ((header->entries - header->buckets) / sizeof(uint32_t) < header->nbuckets + 1)
+        return 0;
+    if ((header->data - header->entries) / sizeof(struct hashsnap_entry) < header->count)
+        return 0;
+    return 1;
+}
+int hashsnap_init(struct hashsnap* hs,const char* path)
+{
+    /* map the snapshot at 'path'; only the header is checked (including that the
+       sections it describes lie within the file): return 1 if the file cannot be
+       mapped or was not written by a compatible hashsnap_write */
+    int fd;
+    struct stat st;
+    const struct hashsnap_header* header;
+    memset(hs,0,sizeof(struct hashsnap));
+    fd = open(path,O_RDONLY);
+    if (fd == -1)
+        return 1;
+    if (fstat(fd,&st) == -1 || (size_t)st.st_size < sizeof(struct hashsnap_header)) {
+        close(fd);
+        return 1;
+    }
+    hs->hs_size = st.st_size;
+    hs->hs_base = mmap(NULL,hs->hs_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if (hs->hs_base == MAP_FAILED) {
+        hs->hs_base = NULL;
+        return 1;
+    }
+    header = hs->hs_base;
+    if (memcmp(header->magic,HASHSNAP_MAGIC,8) != 0 || header->byteorder != HASHSNAP_BYTEORDER
+        || header->version != HASHSNAP_VERSION || header->size != hs->hs_size
+        || header->count > INT32_MAX || header->nbuckets == 0 || header->nbuckets > UINT32_MAX - 1
+        || !hashsnap_check_sections(header)) {
+        hashsnap_delete(hs);
+        return 1;
+    }
+    hs->hs_count = header->count;
+    hs->hs_nbuckets = header->nbuckets;
+    hs->hs_buckets = (const uint32_t*)((const char*)hs->hs_base + header->buckets);
+    hs->hs_entries = (const struct hashsnap_entry*)((const char*)hs->hs_base + header->entries);
+    hs->hs_data = (const unsigned char*)hs->hs_base + header->data;
+    hs->hs_seed = header->seed;
+    /* lookups touch the file at random */
+    madvise(hs->hs_base,hs->hs_size,MADV_RANDOM);
+    return 0;
+}
+void hashsnap_delete(struct hashsnap* hs)
+{
+    if (hs->hs_base != NULL)
+        munmap(hs->hs_base,hs->hs_size);
+    memset(hs,0,sizeof(struct hashsnap));
+}
+const void* hashsnap_lookup(struct hashsnap* hs,const void* key,size_t keylen,size_t* vallen)
+{
+    /* find 'key' and return a pointer to its payload (which is valid as long as the
+       snapshot is open) or NULL if it is not in the snapshot; the payload's length
+       is stored in 'vallen' if it is not NULL */
+    uint32_t i, end, bucket;
+    uint64_t hash, limit;
+    hash = hash64_bytes(key,keylen,hs->hs_seed);
+    bucket = hashsnap_bucket(hash,hs->hs_nbuckets);
+    end = hs->hs_buckets[bucket+1];
+    if (end > (uint32_t)hs->hs_count)
+        return NULL;
+    limit = hs->hs_size - (hs->hs_data - (const unsigned char*)hs->hs_base);
+    for (i = hs->hs_buckets[bucket];i < end;++i) {
+        const struct hashsnap_entry* e = hs->hs_entries + i;
+        if (e->hash != hash || e->keylen != keylen)
+            continue;
+        /* the bounds are checked here rather than when the file is opened */
+        if (e->offset > limit || hashsnap_align(keylen) + e->vallen > limit - e->offset)
+            return NULL;
+        if (memcmp(hs->hs_data + e->offset,key,keylen) == 0) {
+            if (vallen != NULL)
+                *vallen = e->vallen;
+            return hs->hs_data + e->offset + hashsnap_align(keylen);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,47 @@
+/* hashsnap.h */
+#ifndef DSTRUCTS_HASHSNAP_H
+#define DSTRUCTS_HASHSNAP_H
+#include "hashmap.h"
+
+struct hashsnap_entry;
+
+/* describes the bytes that are written to a snapshot for one key of a hashmap:
+   'key' is what later lookups will be made with and 'value' is an optional
+   payload that is stored along with it */
+struct hashsnap_record
+{
+    const void* key;
+    size_t keylen;
+    const void* value;
+    size_t vallen;
+};
+
+/* fills out 'record' for the map key 'key'; the pointers must stay valid until
+   the snapshot has been written */
+typedef void (*hashsnap_encoder)(const void* key,struct hashsnap_record* record);
+
+/* represents a read-only hash table that is served directly from a memory mapped
+   snapshot file; the file uses offsets rather than pointers so it can be mapped
+   at any address, and nothing is parsed or allocated per key when it is opened:
+   several processes that open the same file share its pages; a lookup is made
+   with the raw bytes of a key and returns a pointer to the stored payload within
+   the mapping; the file is in the byte order of the machine that wrote it */
+struct hashsnap
+{
+    void* hs_base; /* start of the mapping */
+    size_t hs_size;
+    int hs_count;
+    uint32_t hs_nbuckets;
+    const uint32_t* hs_buckets;
+    const struct hashsnap_entry* hs_entries;
+    const unsigned char* hs_data;
+    uint64_t hs_seed;
+};
+int hashsnap_write(struct hashmap* hm,const char* path,hashsnap_encoder encode);
+struct hashsnap* hashsnap_new(const char* path);
+void hashsnap_free(struct hashsnap* hs);
+int hashsnap_init(struct hashsnap* hs,const char* path);
+void hashsnap_delete(struct hashsnap* hs);
+const void* hashsnap_lookup(struct hashsnap* hs,const void* key,size_t keylen,size_t* vallen);
+
+#endif
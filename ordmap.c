@@ -0,0 +1,301 @@
+/* ordmap.c - implements a compact, insertion-ordered hash table */
+#include "ordmap.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/* structures used by the implementation */
+struct ordmap_entry
+{
+    uint64_t hash;
+    void* key; /* NULL if the key was removed */
+};
+
+/* an index slot holds the number of an entry or -1 if it is empty; a removed
+   entry keeps its slot (and its hash) so that probe sequences through it stay
+   intact until the entries are compacted; the index is kept at most 2/3 full */
+#define ORDMAP_MIN_ISIZE 8
+#define ORDMAP_EMPTY -1
+#define ORDMAP_PERTURB_SHIFT 5
+
+static inline int ordmap_index_get(struct ordmap* om,int slot)
+{
+    if (om->om_isize <= 128)
+        return ((signed char*)om->om_index)[slot];
+    if (om->om_isize <= 32768)
+        return ((short*)om->om_index)[slot];
+    return ((int*)om->om_index)[slot];
+}
+static inline void ordmap_index_set(struct ordmap* om,int slot,int ix)
+{
+    if (om->om_isize <= 128)
+        ((signed char*)om->om_index)[slot] = ix;
+    else if (om->om_isize <= 32768)
+        ((short*)om->om_index)[slot] = ix;
+    else
+        ((int*)om->om_index)[slot] = ix;
+}
+static inline size_t ordmap_index_bytes(int isize)
+{
+    if (isize <= 128)
+        return isize;
+    if (isize <= 32768)
+        return isize * sizeof(short);
+    return isize * sizeof(int);
+}
+static inline uint64_t ordmap_hash(struct ordmap* om,const void* key)
+{
+    uint64_t h;
+    if (om->om_hash64 != NULL)
+        return (*om->om_hash64)(key,om->om_seed);
+    /* widen the reduced hash with the MurmurHash3 finalizer */
+    h = (uint64_t)(unsigned int)(*om->om_hash)(key,INT_MAX);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+/* probe sequence: the perturbation brings the high bits of the hash into play */
+static inline int ordmap_probe_first(struct ordmap* om,uint64_t hash,uint64_t* perturb)
+{
+    *perturb = hash;
+    return (int)(hash & (uint64_t)(om->om_isize-1));
+}
+static inline int ordmap_probe_next(struct ordmap* om,int slot,uint64_t* perturb)
+{
+    *perturb >>= ORDMAP_PERTURB_SHIFT;
+    return (int)(((uint64_t)slot*5 + *perturb + 1) & (uint64_t)(om->om_isize-1));
+}
+
+static int ordmap_find(struct ordmap* om,const void* key,uint64_t hash)
+{
+    /* return the number of the entry holding 'key' or -1 */
+    int slot;
+    uint64_t perturb;
+    slot = ordmap_probe_first(om,hash,&perturb);
+    while (1) {
+        int ix;
+        struct ordmap_entry* e;
+        ix = ordmap_index_get(om,slot);
+        if (ix == ORDMAP_EMPTY)
+            return -1;
+        e = om->om_entries + ix;
+        if (e->hash == hash && e->key != NULL && (*om->om_compar)(e->key,key) == 0)
+            return ix;
+        slot = ordmap_probe_next(om,slot,&perturb);
+    }
+}
+static int ordmap_find_empty(struct ordmap* om,uint64_t hash)
+{
+    int slot;
+    uint64_t perturb;
+    slot = ordmap_probe_first(om,hash,&perturb);
+    while (ordmap_index_get(om,slot) != ORDMAP_EMPTY)
+        slot = ordmap_probe_next(om,slot,&perturb);
+    return slot;
+}
+static void ordmap_alloc(struct ordmap* om,int isize)
+{
+    /* the index and the entries share one allocation */
+    size_t ibytes;
+    ibytes = (ordmap_index_bytes(isize) + sizeof(struct ordmap_entry)-1) & ~(sizeof(struct ordmap_entry)-1);
+    om->om_isize = isize;
+    om->om_capacity = isize*2/3;
+    om->om_index = malloc(ibytes + sizeof(struct ordmap_entry) * om->om_capacity);
+    om->om_entries = (struct ordmap_entry*)((char*)om->om_index + ibytes);
+    memset(om->om_index,0xff,ordmap_index_bytes(isize));
+    om->om_used = 0;
+}
+static void ordmap_resize(struct ordmap* om)
+{
+    /* compact the live entries (keeping their order) into a table sized for three
+       times the number of live keys, then rebuild the index */
+    int i, isize;
+    void* oldindex;
+    struct ordmap_entry* old;
+    int oldused;
+    oldindex = om->om_index;
+    old = om->om_entries;
+    oldused = om->om_used;
+    isize = ORDMAP_MIN_ISIZE;
+    while (isize < om->om_count*3)
+        isize <<= 1;
+    ordmap_alloc(om,isize);
+    for (i = 0;i < oldused;++i) {
+        if (old[i].key != NULL) {
+            ordmap_index_set(om,ordmap_find_empty(om,old[i].hash),om->om_used);
+            om->om_entries[om->om_used++] = old[i];
+        }
+    }
+    free(oldindex);
+}
+
+struct ordmap* ordmap_new(int size,hash_function hash,key_comparator compar)
+{
+    struct ordmap* om;
+    om = malloc(sizeof(struct ordmap));
+    if (om == NULL)
+        return NULL;
+    ordmap_init(om,size,hash,compar);
+    return om;
+}
+struct ordmap* ordmap_new_ex(int size,hash64_function hash,key_comparator compar)
+{
+    struct ordmap* om;
+    om = malloc(sizeof(struct ordmap));
+    if (om == NULL)
+        return NULL;
+    ordmap_init_ex(om,size,hash,compar);
+    return om;
+}
+void ordmap_free(struct ordmap* om)
+{
+    ordmap_delete(om);
+    free(om);
+}
+void ordmap_free_ex(struct ordmap* om,destructor dstor)
+{
+    ordmap_delete_ex(om,dstor);
+    free(om);
+}
+void ordmap_init(struct ordmap* om,int size,hash_function hash,key_comparator compar)
+{
+    /* 'size' is the number of keys the map should hold before it must grow */
+    int isize;
+    isize = ORDMAP_MIN_ISIZE;
+    while (isize*2/3 < size)
+        isize <<= 1;
+    ordmap_alloc(om,isize);
+    om->om_count = 0;
+    om->om_hash = hash;
+    om->om_hash64 = NULL;
+    om->om_seed = 0;
+    om->om_compar = compar;
+}
+void ordmap_init_ex(struct ordmap* om,int size,hash64_function hash,key_comparator compar)
+{
+    ordmap_init(om,size,NULL,compar);
+    om->om_hash64 = hash;
+    om->om_seed = hash_random_seed();
+}
+void ordmap_delete(struct ordmap* om)
+{
+    free(om->om_index);
+    om->om_index = NULL;
+    om->om_entries = NULL;
+    om->om_count = 0;
+    om->om_used = 0;
+    om->om_capacity = 0;
+    om->om_isize = 0;
+    om->om_hash = NULL;
+    om->om_hash64 = NULL;
+    om->om_compar = NULL;
+}
+void ordmap_delete_ex(struct ordmap* om,destructor dstor)
+{
+    ordmap_traversal(om,dstor);
+    ordmap_delete(om);
+}
+void ordmap_reset(struct ordmap* om)
+{
+    /* if the index is large compared to the number of entries then clear just
+       the slots that the entries occupy: each entry's slot is found by following
+       its probe sequence, which costs about as much as the original insert */
+    int i;
+    if (om->om_used*8 < om->om_isize) {
+        for (i = 0;i < om->om_used;++i) {
+            int slot;
+            uint64_t perturb;
+            slot = ordmap_probe_first(om,om->om_entries[i].hash,&perturb);
+            while (ordmap_index_get(om,slot) != i)
+                slot = ordmap_probe_next(om,slot,&perturb);
+            ordmap_index_set(om,slot,ORDMAP_EMPTY);
+        }
+    }
+    else
+        memset(om->om_index,0xff,ordmap_index_bytes(om->om_isize));
+    om->om_used = 0;
+    om->om_count = 0;
+}
+void ordmap_reset_ex(struct ordmap* om,destructor dstor)
+{
+    ordmap_traversal(om,dstor);
+    ordmap_reset(om);
+}
+int ordmap_insert(struct ordmap* om,void* key)
+{
+    uint64_t hash;
+    hash = ordmap_hash(om,key);
+    if (ordmap_find(om,key,hash) >= 0)
+        return 1;
+    if (om->om_used >= om->om_capacity)
+        ordmap_resize(om);
+    ordmap_index_set(om,ordmap_find_empty(om,hash),om->om_used);
+    om->om_entries[om->om_used].hash = hash;
+    om->om_entries[om->om_used].key = key;
+    ++om->om_used;
+    ++om->om_count;
+    return 0;
+}
+void* ordmap_lookup(struct ordmap* om,const void* key)
+{
+    int ix;
+    ix = ordmap_find(om,key,ordmap_hash(om,key));
+    if (ix < 0)
+        return NULL;
+    return om->om_entries[ix].key;
+}
+static void* ordmap_remove_generic(struct ordmap* om,const void* key)
+{
+    int ix;
+    void* r;
+    ix = ordmap_find(om,key,ordmap_hash(om,key));
+    if (ix < 0)
+        return NULL;
+    r = om->om_entries[ix].key;
+    om->om_entries[ix].key = NULL;
+    --om->om_count;
+    return r;
+}
+int ordmap_remove(struct ordmap* om,const void* key)
+{
+    if (ordmap_remove_generic(om,key) == NULL)
+        return 1;
+    return 0;
+}
+int ordmap_remove_ex(struct ordmap* om,const void* key,destructor dstor)
+{
+    void* result;
+    result = ordmap_remove_generic(om,key);
+    if (result == NULL)
+        return 1;
+    (*dstor)(result);
+    return 0;
+}
+void* ordmap_next(struct ordmap* om,int* iter)
+{
+    /* return the next key in insertion order or NULL when there are no more; set
+       '*iter' to zero to start from the first key */
+    while (*iter < om->om_used) {
+        void* key = om->om_entries[(*iter)++].key;
+        if (key != NULL)
+            return key;
+    }
+    return NULL;
+}
+void ordmap_traversal(struct ordmap* om,key_callback callback)
+{
+    int i;
+    for (i = 0;i < om->om_used;++i)
+        if (om->om_entries[i].key != NULL)
+            (*callback)(om->om_entries[i].key);
+}
+void ordmap_traversal_ex(struct ordmap* om,key_callback_ex callback,void* data)
+{
+    int i;
+    for (i = 0;i < om->om_used;++i)
+        if (om->om_entries[i].key != NULL)
+            (*callback)(om->om_entries[i].key,data);
+}
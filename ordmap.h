@@ -0,0 +1,47 @@
+/* ordmap.h */
+#ifndef DSTRUCTS_ORDMAP_H
+#define DSTRUCTS_ORDMAP_H
+#include "hashmap.h"
+
+struct ordmap_entry;
+
+/* represents a compact hash table that implements a map data structure and
+   remembers insertion order; the keys live in a dense array of entries (in the
+   order they were inserted) and a separate index table of small integers maps
+   hash addresses to entries; the index uses 1, 2 or 4 byte slots depending on
+   its size; the map provides the same interface as 'struct hashmap'; in addition
+   the keys can be visited in insertion order by scanning the entries, and a
+   reset only costs time proportional to the number of entries; as with flatmap,
+   a 'hash_function' is called with INT_MAX as the size */
+struct ordmap
+{
+    int om_count; /* number of keys in the map */
+    int om_used; /* number of entries used, including removed ones */
+    int om_capacity; /* number of entries allocated */
+    int om_isize; /* number of index slots; a power of two */
+    void* om_index;
+    struct ordmap_entry* om_entries;
+    hash_function om_hash;
+    hash64_function om_hash64;
+    uint64_t om_seed;
+    key_comparator om_compar;
+};
+struct ordmap* ordmap_new(int size,hash_function hash,key_comparator compar);
+struct ordmap* ordmap_new_ex(int size,hash64_function hash,key_comparator compar);
+void ordmap_free(struct ordmap* om);
+void ordmap_free_ex(struct ordmap* om,destructor dstor);
+void ordmap_init(struct ordmap* om,int size,hash_function hash,key_comparator compar);
+void ordmap_init_ex(struct ordmap* om,int size,hash64_function hash,key_comparator compar);
+void ordmap_delete(struct ordmap* om);
+void ordmap_delete_ex(struct ordmap* om,destructor dstor);
+void ordmap_reset(struct ordmap* om);
+void ordmap_reset_ex(struct ordmap* om,destructor dstor);
+int ordmap_insert(struct ordmap* om,void* key);
+void* ordmap_lookup(struct ordmap* om,const void* key);
+int ordmap_remove(struct ordmap* om,const void* key);
+int ordmap_remove_ex(struct ordmap* om,const void* key,destructor dstor);
+void* ordmap_next(struct ordmap* om,int* iter);
+void ordmap_traversal(struct ordmap* om,key_callback callback);
+void ordmap_traversal_ex(struct ordmap* om,key_callback_ex callback,void* data);
+
+#endif
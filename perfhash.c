@@ -0,0 +1,283 @@
+/* perfhash.c - implements a minimal perfect hash table for static key sets */
+#include "perfhash.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* construction parameters: the average number of keys per bucket, the load
+   factor (in percent) of the hash function's range, the largest pilot value
+   that is tried for a bucket and the number of seeds that are tried before the
+   construction gives up */
+#define PERFHASH_BUCKET_KEYS 4
+#define PERFHASH_LOAD 98
+#define PERFHASH_MAX_PILOT (1 << 20)
+#define PERFHASH_MAX_ATTEMPTS 32
+
+/* structures used by the implementation */
+struct perfhash_item
+{
+    uint64_t hash;
+    int index; /* index of the key in the input array */
+    int pos;
+};
+
+/* the bucket is chosen by the low half of the hash; the position by the whole
+   hash mixed with the bucket's pilot */
+static inline int perfhash_bucket(struct perfhash* ph,uint64_t hash)
+{
+    return (int)(((hash & 0xffffffff) * (uint64_t)ph->ph_nbuckets) >> 32);
+}
+static inline int perfhash_position(struct perfhash* ph,uint64_t hash,uint32_t pilot)
+{
+    uint64_t z;
+    z = (uint64_t)pilot ^ ph->ph_seed;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z = ((z ^ (z >> 31)) ^ hash) * 0x9e3779b97f4a7c15ULL;
+    return (int)(((z >> 32) * (uint64_t)ph->ph_range) >> 32);
+}
+static inline uint32_t perfhash_pilot(struct perfhash* ph,int bucket)
+{
+    if (ph->ph_pilotsize == 1)
+        return ((unsigned char*)ph->ph_pilots)[bucket];
+    if (ph->ph_pilotsize == 2)
+        return ((unsigned short*)ph->ph_pilots)[bucket];
+    return ((uint32_t*)ph->ph_pilots)[bucket];
+}
+static int perfhash_build(struct perfhash* ph,void** keys,int size)
+{
+    /* try to build the table with the current seed; return 0 on success, 1 if
+       'keys' contains duplicates or -1 if another seed should be tried */
+    int i, j, k, b, result;
+    int maxsize;
+    uint32_t maxpilot;
+    int* start, *order, *bysize;
+    uint32_t* pilots;
+    uint64_t* taken;
+    struct perfhash_item* items, *bucket;
+    result = 0;
+    items = malloc(sizeof(struct perfhash_item) * size);
+    start = calloc(ph->ph_nbuckets+1,sizeof(int));
+    order = malloc(sizeof(int) * size);
+    pilots = calloc(ph->ph_nbuckets,sizeof(uint32_t));
+    taken = calloc((ph->ph_range+63)/64,sizeof(uint64_t));
+    bysize = NULL;
+    /* hash the keys and sort them by bucket (counting sort); 'order' holds the
+       items of bucket 'b' in [start[b],start[b+1]) */
+    for (i = 0;i < size;++i) {
+        items[i].hash = (*ph->ph_hash)(keys[i],ph->ph_seed);
+        items[i].index = i;
+        ++start[perfhash_bucket(ph,items[i].hash)+1];
+    }
+    maxsize = 0;
+    for (b = 0;b < ph->ph_nbuckets;++b) {
+        if (start[b+1] > maxsize)
+            maxsize = start[b+1];
+        start[b+1] += start[b];
+    }
+    for (i = 0;i < size;++i) {
+        b = perfhash_bucket(ph,items[i].hash);
+        order[--start[b+1]] = i;
+    }
+    /* 'start[b+1]' was decremented back to the start of bucket 'b' */
+    for (b = 0;b < ph->ph_nbuckets;++b)
+        start[b] = start[b+1];
+    start[ph->ph_nbuckets] = size;
+    /* keys with identical hashes can never be separated: either they are
+       duplicates or another seed is needed */
+    for (b = 0;b < ph->ph_nbuckets && result == 0;++b) {
+        for (i = start[b];i < start[b+1] && result == 0;++i) {
+            for (j = i+1;j < start[b+1];++j) {
+                if (items[order[i]].hash == items[order[j]].hash) {
+                    if ((*ph->ph_compar)(keys[items[order[i]].index],keys[items[order[j]].index]) == 0)
+                        result = 1;
+                    else
+                        result = -1;
+                    break;
+                }
+            }
+        }
+    }
+    if (result != 0)
+        goto done;
+    /* place the buckets largest first; 'bysize' lists the buckets ordered by size */
+    bysize = malloc(sizeof(int) * ph->ph_nbuckets);
+    {
+        int* cnt = calloc(maxsize+2,sizeof(int));
+        for (b = 0;b < ph->ph_nbuckets;++b)
+            ++cnt[maxsize - (start[b+1]-start[b]) + 1];
+        for (k = 0;k <= maxsize;++k)
+            cnt[k+1] += cnt[k];
+        for (b = 0;b < ph->ph_nbuckets;++b)
+            bysize[cnt[maxsize - (start[b+1]-start[b])]++] = b;
+        free(cnt);
+    }
+    maxpilot = 0;
+    for (k = 0;k < ph->ph_nbuckets;++k) {
+        uint32_t p;
+        int n;
+        b = bysize[k];
+        n = start[b+1] - start[b];
+        if (n == 0)
+            break;
+        for (p = 0;p < PERFHASH_MAX_PILOT;++p) {
+            for (i = 0;i < n;++i) {
+                bucket = items + order[start[b]+i];
+                bucket->pos = perfhash_position(ph,bucket->hash,p);
+                if (taken[bucket->pos/64] & (1ULL << (bucket->pos%64)))
+                    break;
+                for (j = 0;j < i;++j)
+                    if (items[order[start[b]+j]].pos == bucket->pos)
+                        break;
+                if (j < i)
+                    break;
+            }
+            if (i == n)
+                break;
+        }
+        if (p == PERFHASH_MAX_PILOT) {
+            result = -1;
+            goto done;
+        }
+        for (i = 0;i < n;++i) {
+            int pos = items[order[start[b]+i]].pos;
+            taken[pos/64] |= 1ULL << (pos%64);
+        }
+        pilots[b] = p;
+        if (p > maxpilot)
+            maxpilot = p;
+    }
+    /* positions past the end of the table are remapped onto the free slots
+       within it; there are exactly as many of each */
+    ph->ph_remap = malloc(sizeof(int) * (ph->ph_range - size + 1));
+    for (i = size,j = 0;i < ph->ph_range;++i) {
+        ph->ph_remap[i-size] = -1;
+        if (taken[i/64] & (1ULL << (i%64))) {
+            while (taken[j/64] & (1ULL << (j%64)))
+                ++j;
+            ph->ph_remap[i-size] = j++;
+        }
+    }
+    ph->ph_keys = malloc(sizeof(void*) * (size > 0 ? size : 1));
+    for (i = 0;i < size;++i) {
+        int pos = items[i].pos;
+        if (pos >= size)
+            pos = ph->ph_remap[pos-size];
+        ph->ph_keys[pos] = keys[items[i].index];
+    }
+    /* store the pilots in the narrowest width that holds them */
+    ph->ph_pilotsize = maxpilot <= 0xff ? 1 : (maxpilot <= 0xffff ? 2 : 4);
+    ph->ph_pilots = malloc(ph->ph_pilotsize * ph->ph_nbuckets);
+    for (b = 0;b < ph->ph_nbuckets;++b) {
+        if (ph->ph_pilotsize == 1)
+            ((unsigned char*)ph->ph_pilots)[b] = pilots[b];
+        else if (ph->ph_pilotsize == 2)
+            ((unsigned short*)ph->ph_pilots)[b] = pilots[b];
+        else
+            ((uint32_t*)ph->ph_pilots)[b] = pilots[b];
+    }
+done:
+    free(items);
+    free(start);
+    free(order);
+    free(pilots);
+    free(taken);
+    free(bysize);
+    return result;
+}
+
+struct perfhash* perfhash_new(void** keys,int size,hash64_function hash,key_comparator compar)
+{
+    struct perfhash* ph;
+    ph = malloc(sizeof(struct perfhash));
+    if (ph == NULL)
+        return NULL;
+    if (perfhash_init(ph,keys,size,hash,compar) != 0) {
+        free(ph);
+        return NULL;
+    }
+    return ph;
+}
+void perfhash_free(struct perfhash* ph)
+{
+    if (ph != NULL) {
+        perfhash_delete(ph);
+        free(ph);
+    }
+}
+void perfhash_free_ex(struct perfhash* ph,destructor dstor)
+{
+    if (ph != NULL) {
+        perfhash_delete_ex(ph,dstor);
+        free(ph);
+    }
+}
+int perfhash_init(struct perfhash* ph,void** keys,int size,hash64_function hash,key_comparator compar)
+{
+    /* build the table from the 'size' keys in 'keys'; the table refers to the keys
+       but does not copy the array; return non-zero if the keys contain duplicates
+       (or, extremely unlikely, no suitable seed was found) */
+    int attempt, result;
+    if (size < 0)
+        size = 0;
+    ph->ph_count = size;
+    ph->ph_nbuckets = size/PERFHASH_BUCKET_KEYS + 1;
+    ph->ph_range = (int)((int64_t)size * 100 / PERFHASH_LOAD) + 1;
+    ph->ph_hash = hash;
+    ph->ph_compar = compar;
+    ph->ph_pilots = NULL;
+    ph->ph_remap = NULL;
+    ph->ph_keys = NULL;
+    result = -1;
+    for (attempt = 0;attempt < PERFHASH_MAX_ATTEMPTS && result < 0;++attempt) {
+        ph->ph_seed = hash_random_seed();
+        result = perfhash_build(ph,keys,size);
+    }
+    if (result != 0) {
+        perfhash_delete(ph);
+        return 1;
+    }
+    return 0;
+}
+void perfhash_delete(struct perfhash* ph)
+{
+    free(ph->ph_pilots);
+    free(ph->ph_remap);
+    free(ph->ph_keys);
+    ph->ph_pilots = NULL;
+    ph->ph_remap = NULL;
+    ph->ph_keys = NULL;
+    ph->ph_count = 0;
+    ph->ph_nbuckets = 0;
+    ph->ph_range = 0;
+    ph->ph_hash = NULL;
+    ph->ph_compar = NULL;
+}
+void perfhash_delete_ex(struct perfhash* ph,destructor dstor)
+{
+    int i;
+    for (i = 0;i < ph->ph_count;++i)
+        (*dstor)(ph->ph_keys[i]);
+    perfhash_delete(ph);
+}
+int perfhash_index(struct perfhash* ph,const void* key)
+{
+    /* return the slot in [0,ph_count) that 'key' maps to; this is only meaningful
+       for keys in the set: any other key maps to some arbitrary slot */
+    int pos;
+    uint64_t hash;
+    hash = (*ph->ph_hash)(key,ph->ph_seed);
+    pos = perfhash_position(ph,hash,perfhash_pilot(ph,perfhash_bucket(ph,hash)));
+    if (pos >= ph->ph_count)
+        pos = ph->ph_remap[pos - ph->ph_count];
+    return pos;
+}
+void* perfhash_lookup(struct perfhash* ph,const void* key)
+{
+    int pos;
+    if (ph->ph_count == 0)
+        return NULL;
+    pos = perfhash_index(ph,key);
+    if (pos < 0 || (*ph->ph_compar)(ph->ph_keys[pos],key) != 0)
+        return NULL;
+    return ph->ph_keys[pos];
+}
@@ -0,0 +1,36 @@
+/* perfhash.h */
+#ifndef DSTRUCTS_PERFHASH_H
+#define DSTRUCTS_PERFHASH_H
+#include "hashmap.h"
+
+/* represents a read-only map built from a fixed set of keys using a minimal perfect
+   hash function (the PTHash construction): each key's hash selects a bucket, and
+   each bucket stores a small 'pilot' value that was chosen when the table was
+   built so that the keys of every bucket land on distinct slots; a lookup thus
+   costs one hash, one probe and one comparison; the table stores one key pointer
+   per key plus a few bits per key: a 1 or 2 byte pilot for every bucket of about
+   four keys (2-4 bits per key) and a remap entry for each of the 2% of positions
+   past the last slot */
+struct perfhash
+{
+    int ph_count; /* number of keys and slots */
+    int ph_nbuckets;
+    int ph_range; /* size of the range of the hash function; slightly larger than 'ph_count' */
+    int ph_pilotsize; /* width of each pilot in bytes (1, 2 or 4) */
+    void* ph_pilots;
+    int* ph_remap; /* maps positions in [ph_count,ph_range) onto free slots */
+    void** ph_keys;
+    hash64_function ph_hash;
+    uint64_t ph_seed;
+    key_comparator ph_compar;
+};
+struct perfhash* perfhash_new(void** keys,int size,hash64_function hash,key_comparator compar);
+void perfhash_free(struct perfhash* ph);
+void perfhash_free_ex(struct perfhash* ph,destructor dstor);
+int perfhash_init(struct perfhash* ph,void** keys,int size,hash64_function hash,key_comparator compar);
+void perfhash_delete(struct perfhash* ph);
+void perfhash_delete_ex(struct perfhash* ph,destructor dstor);
+int perfhash_index(struct perfhash* ph,const void* key);
+void* perfhash_lookup(struct perfhash* ph,const void* key);
+
+#endif
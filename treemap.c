@@ -1,23 +1,41 @@
 /* treemap.c - implements 2-3 tree-based map data structure */
 #include "treemap.h"
-#include "dynarray.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 /* structures used by the implementation */
 struct tree_node
 {
     void* keys[3];
     struct tree_node* children[4];
+    int size; /* number of keys in the subtree rooted at this node */
+    atomic_int refs; /* number of parents and roots referring to the node (persistent mode) */
+};
+/* a node from a wide pool is followed by the normalized prefixes of its keys on
+   the next cache line; they are kept up to date only in a map that has a
+   normalizer and only read by a search in such a map */
+struct tree_node_wide
+{
+    struct tree_node node;
+    uint64_t norms[3];
 };
 struct key_info
 {
     key_comparator compar;
     destructor dstor;
+    struct tree_node_pool* pool;
+    /* if 'track' is not NULL then 'slot' is kept pointing at the position of that
+       key (the key being inserted) as nodes are modified */
+    void* track;
+    void** slot;
 };
 struct key_impl_info
 {
     void* key;
+    const uint64_t* norm;
     struct key_info* keyinfo;
 };
 struct search_impl_info
@@ -27,6 +45,69 @@ struct search_impl_info
     struct key_impl_info info;
 };
 
+/* nodes are carved from slabs owned by a pool; each new slab is twice as large
+   as the last (up to a limit); the nodes start at a cache line boundary after
+   the slab header so that each (64 byte) node sits on a line of its own (a wide
+   node takes two lines); freed
+   nodes go on a free list linked through 'children[0]' */
+#define TREE_SLAB_MIN 16
+#define TREE_SLAB_MAX 1024
+#define TREE_SLAB_ALIGN 64
+#define TREE_WIDE_SIZE 128
+
+/* treemap_insert_sorted merges and rebuilds unless the batch is smaller than
+   this fraction of the tree; the set operations likewise look keys up instead
+   of merging when one map is smaller than this fraction of the other */
+#define TREEMAP_MERGE_RATIO 16
+
+/* which keys treemap_merge_keys keeps: those only in the left map, those in both
+   maps and those only in the right map */
+#define TREEMAP_MERGE_LEFT 1
+#define TREEMAP_MERGE_BOTH 2
+#define TREEMAP_MERGE_RIGHT 4
+
+/* shared state of a persistent map and its snapshots; nodes reference counted
+   down to zero by a snapshot released on another thread cannot go back on the
+   pool's free list there, so they are pushed on 'garbage' (linked through
+   'children[0]') for the writer to collect; removed keys that a live snapshot
+   might still hold are retired along with the snapshot version at removal and
+   destroyed once every snapshot older than that version has been released */
+struct treemap_retired
+{
+    void* key;
+    int64_t version;
+};
+struct treemap_cow
+{
+    pthread_mutex_t lock; /* protects 'live' */
+    int64_t* live; /* versions of the live snapshots in increasing order */
+    int nlive, livecap;
+    atomic_llong oldest; /* least live snapshot version or INT64_MAX */
+    int64_t version; /* version of the next snapshot (writer only) */
+    _Atomic(struct tree_node*) garbage;
+    struct treemap_retired* retired; /* in order of version (writer only) */
+    int nretired, retcap;
+};
+
+struct tree_node_slab
+{
+    struct tree_node_slab* next;
+    int size;
+    int used;
+};
+static inline char* tree_node_slab_nodes(struct tree_node_slab* slab)
+{
+    return (char*)slab + TREE_SLAB_ALIGN;
+}
+static inline size_t tree_node_stride(struct tree_node_pool* pool)
+{
+    return pool->wide ? TREE_WIDE_SIZE : sizeof(struct tree_node);
+}
+static inline uint64_t* tree_node_norms(struct tree_node* node)
+{
+    return ((struct tree_node_wide*)node)->norms;
+}
+
 /* tree_string_key */
 void tree_string_key_init(struct tree_string_key* key,const char* keyval,void* payload)
 {
@@ -55,6 +136,23 @@ int tree_string_key_compare(const struct tree_string_key* left,const struct tree
     }
     return *l - *r;
 }
+uint64_t tree_string_key_normalize(const struct tree_string_key* key)
+{
+    /* the first eight bytes (up to the terminator) in big-endian order; the
+       comparator subtracts plain chars, so where they are signed the bytes are
+       offset to put negative ones first */
+    int i;
+    uint64_t norm;
+    const char* k = key->key;
+    const unsigned char bias = (char)-1 < 0 ? 0x80 : 0;
+    norm = 0;
+    for (i = 0;i < 8;++i) {
+        norm = (norm << 8) | (unsigned char)(*k ^ bias);
+        if (*k)
+            ++k;
+    }
+    return norm;
+}
 int tree_string_key_compare_insensitive(const struct tree_string_key* left,const struct tree_string_key* right)
 {
     const char* l = left->key;
@@ -75,6 +173,14 @@ int tree_string_key_compare_insensitive(const struct tree_string_key* left,const
 }
 
 /* tree_node */
+static inline void tree_node_track(struct tree_node* node,struct key_info* info)
+{
+    int i;
+    if (info->track != NULL)
+        for (i = 0;i < 3;++i)
+            if (node->keys[i] == info->track)
+                info->slot = node->keys + i;
+}
 static void tree_node_init(struct tree_node* node)
 {
     int i;
@@ -82,192 +188,322 @@ static void tree_node_init(struct tree_node* node)
         node->keys[i] = NULL;
     for (i = 0;i < 4;++i)
         node->children[i] = NULL;
+    node->size = 0;
+    atomic_store_explicit(&node->refs,1,memory_order_relaxed);
 }
-static void tree_node_delete(struct tree_node* node)
+static struct tree_node_slab* tree_node_slab_new(struct tree_node_pool* pool,int size)
 {
-    /* this function does not delete the node's keys; that task is left
-       up to the user; the references are simply discarded as the tree_node
-       object is about to be deleted */
-    int i;
-    for (i = 0;i < 4;++i) {
-        if (node->children[i] != NULL) {
-            tree_node_delete(node->children[i]);
-            free(node->children[i]);
+    size_t bytes;
+    struct tree_node_slab* slab;
+    bytes = TREE_SLAB_ALIGN + tree_node_stride(pool) * size;
+    bytes = (bytes + TREE_SLAB_ALIGN-1) & ~(size_t)(TREE_SLAB_ALIGN-1);
+    slab = aligned_alloc(TREE_SLAB_ALIGN,bytes);
+    slab->next = pool->slabs;
+    slab->size = size;
+    slab->used = 0;
+    pool->slabs = slab;
+    return slab;
+}
+static void tree_node_reserve(struct tree_node_pool* pool,int count)
+{
+    /* make the next 'count' nodes (that are not taken from the free list) come
+       from a single block */
+    if (pool->slabs == NULL || pool->slabs->size - pool->slabs->used < count)
+        tree_node_slab_new(pool,count);
+}
+static struct tree_node* tree_node_new(struct tree_node_pool* pool)
+{
+    struct tree_node* node;
+    struct tree_node_slab* slab;
+    if (pool->free != NULL) {
+        node = pool->free;
+        pool->free = node->children[0];
+    }
+    else {
+        slab = pool->slabs;
+        if (slab == NULL || slab->used >= slab->size) {
+            int size;
+            size = slab == NULL ? TREE_SLAB_MIN : slab->size * 2;
+            if (size > TREE_SLAB_MAX)
+                size = TREE_SLAB_MAX;
+            slab = tree_node_slab_new(pool,size);
         }
+        node = (struct tree_node*)(tree_node_slab_nodes(slab) + tree_node_stride(pool) * slab->used++);
     }
+    tree_node_init(node);
+    return node;
+}
+static inline void tree_node_free(struct tree_node_pool* pool,struct tree_node* node)
+{
+    node->children[0] = pool->free;
+    pool->free = node;
 }
-static void tree_node_delete_dstor(struct tree_node* node,destructor dstor)
+static inline int tree_node_size(struct tree_node* node)
 {
-    /* this function calls a user-provided destructor on each key object */
+    return node != NULL ? node->size : 0;
+}
+static inline int tree_node_key_count(struct tree_node* node)
+{
+    return node->keys[1] != NULL ? 2 : (node->keys[0] != NULL ? 1 : 0);
+}
+static void tree_node_update(struct tree_node* node)
+{
+    /* recompute the subtree count of 'node' from its keys and children */
     int i;
+    node->size = 0;
     for (i = 0;i < 3;++i)
         if (node->keys[i] != NULL)
-            (*dstor)(node->keys[i]);
+            ++node->size;
+    for (i = 0;i < 4;++i)
+        node->size += tree_node_size(node->children[i]);
+}
+static inline int tree_node_compare(struct tree_node* node,int i,const void* key,const uint64_t* norm,key_comparator compar)
+{
+    /* compare 'key' with the key at 'i'; if 'norm' is not NULL it points to the
+       normalized prefix of 'key' and the comparator only decides between keys
+       with equal prefixes */
+    if (norm != NULL && *norm != tree_node_norms(node)[i])
+        return *norm < tree_node_norms(node)[i] ? -1 : 1;
+    return (*compar)(key,node->keys[i]);
+}
+static inline void tree_node_set_key(struct tree_node* node,int i,struct tree_node* from,int j,int wide)
+{
+    /* move the key (and its prefix if the nodes are 'wide') at 'j' in 'from' to
+       'i' in 'node' */
+    if (wide)
+        tree_node_norms(node)[i] = tree_node_norms(from)[j];
+    node->keys[i] = from->keys[j];
+}
+static struct tree_node* tree_node_copy(struct tree_node* node,struct tree_node_pool* pool)
+{
+    /* create an unshared copy of 'node'; its children gain the copy as a parent */
+    int i;
+    struct tree_node* copy;
+    copy = tree_node_new(pool);
+    for (i = 0;i < 3;++i)
+        tree_node_set_key(copy,i,node,i,pool->wide);
     for (i = 0;i < 4;++i) {
-        if (node->children[i] != NULL) {
-            tree_node_delete_dstor(node->children[i],dstor);
-            free(node->children[i]);
-        }
+        copy->children[i] = node->children[i];
+        if (copy->children[i] != NULL)
+            atomic_fetch_add_explicit(&copy->children[i]->refs,1,memory_order_relaxed);
     }
+    copy->size = node->size;
+    return copy;
 }
-static int tree_node_insert_key(struct tree_node* node,struct key_impl_info* info,struct tree_node* left,struct tree_node* right)
+static void tree_node_release(struct tree_node* node,struct treemap_cow* cow,struct tree_node_pool* pool)
 {
-    int i, j;
-    int cmp;
-    if (node->keys[0] == NULL)
-        cmp = -1;
-    else
-        cmp = (*info->keyinfo->compar)(info->key,node->keys[0]);
-    if (cmp == 0)
+    /* drop a reference to 'node'; the last reference releases its children and
+       frees it into 'pool', or onto the garbage stack if 'pool' is NULL (any
+       thread other than the writer); keys are not touched */
+    int i;
+    struct tree_node* top;
+    if (atomic_fetch_sub_explicit(&node->refs,1,memory_order_acq_rel) != 1)
+        return;
+    for (i = 0;i < 4;++i)
+        if (node->children[i] != NULL)
+            tree_node_release(node->children[i],cow,pool);
+    if (pool != NULL) {
+        tree_node_free(pool,node);
+        return;
+    }
+    top = atomic_load_explicit(&cow->garbage,memory_order_relaxed);
+    do {
+        node->children[0] = top;
+    } while (!atomic_compare_exchange_weak_explicit(&cow->garbage,&top,node,memory_order_release,memory_order_relaxed));
+}
+static struct tree_node* tree_node_own(struct tree_node** link,struct treemap_cow* cow,struct tree_node_pool* pool)
+{
+    /* make the node at '*link' safe for the writer to modify: in a persistent map
+       a node that a snapshot (or another version's node) also refers to is
+       replaced by a copy; the node holding 'link' must itself be unshared */
+    struct tree_node* node = *link;
+    if (cow != NULL && atomic_load_explicit(&node->refs,memory_order_acquire) > 1) {
+        *link = tree_node_copy(node,pool);
+        tree_node_release(node,cow,pool);
+    }
+    return *link;
+}
+static int64_t tree_capacity(int height)
+{
+    /* the most keys a 2-3 tree of 'height' levels can hold */
+    int64_t cap = 1;
+    while (height-- > 0)
+        cap *= 3;
+    return cap - 1;
+}
+static int tree_height(int size)
+{
+    /* the least height of a 2-3 tree that holds 'size' keys */
+    int height = 1;
+    while (tree_capacity(height) < size)
+        ++height;
+    return height;
+}
+static int tree_node_build_count(int size,int height)
+{
+    /* the number of nodes tree_node_build creates */
+    int i, c, per, extra, count;
+    if (height == 1)
         return 1;
-    if (cmp < 0) {
-        /* key is inserted into position 0; shift elements over */
-        for (i = 1,j = 2;i >= 0;--i,--j)
-            node->keys[j] = node->keys[i];
-        for (i = 2, j = 3;i >= 0;--i,--j)
-            node->children[j] = node->children[i];
-        node->keys[0] = info->key;
-        node->children[0] = left;
-        node->children[1] = right;
-    }
-    else if (node->keys[1] != NULL) {
-        cmp = (*info->keyinfo->compar)(info->key,node->keys[1]);
-        if (cmp == 0)
-            return 1;
-        if (cmp < 0) {
-            /* key is inserted into position 1; shift elements over */
-            node->keys[2] = node->keys[1];
-            node->children[3] = node->children[2];
-            node->keys[1] = info->key;
-            node->children[1] = left;
-            node->children[2] = right;
+    c = size <= 2*tree_capacity(height-1) + 1 ? 2 : 3;
+    per = (size - (c-1)) / c;
+    extra = (size - (c-1)) % c;
+    count = 1;
+    for (i = 0;i < c;++i)
+        count += tree_node_build_count(per + (i < extra),height-1);
+    return count;
+}
+static struct tree_node* tree_node_build(void** keys,int size,int height,key_normalizer normalizer,struct tree_node_pool* pool)
+{
+    /* build a 2-3 tree of exactly 'height' levels from the sorted, distinct keys
+       in linear time; each node gets two children unless they would be too small
+       to hold the keys, and the keys are spread evenly among the children, which
+       keeps each child within the bounds of its own height */
+    int i, c, pos, per, extra;
+    struct tree_node* node;
+    node = tree_node_new(pool);
+    node->size = size;
+    if (height == 1) {
+        for (i = 0;i < size;++i) {
+            node->keys[i] = keys[i];
+            if (normalizer != NULL)
+                tree_node_norms(node)[i] = (*normalizer)(keys[i]);
         }
-        else {
-            /* key is inserted into position 2; no shift required */
-            node->keys[2] = info->key;
-            node->children[2] = left;
-            node->children[3] = right;
+        return node;
+    }
+    c = size <= 2*tree_capacity(height-1) + 1 ? 2 : 3;
+    per = (size - (c-1)) / c;
+    extra = (size - (c-1)) % c;
+    pos = 0;
+    for (i = 0;i < c;++i) {
+        int len = per + (i < extra);
+        node->children[i] = tree_node_build(keys+pos,len,height-1,normalizer,pool);
+        pos += len;
+        if (i < c-1) {
+            node->keys[i] = keys[pos++];
+            if (normalizer != NULL)
+                tree_node_norms(node)[i] = (*normalizer)(node->keys[i]);
         }
     }
-    else {
-        /* key is inserted into position 1; no shift required */
-        node->keys[1] = info->key;
-        node->children[1] = left;
-        node->children[2] = right;
+    return node;
+}
+static void tree_keys_sort(void** keys,int size,key_comparator compar)
+{
+    /* sort the keys unless they are already in order (as is common for keys that
+       come from a sorted source); the check costs one comparison per key */
+    int i;
+    for (i = 1;i < size;++i) {
+        if ((*compar)(keys[i-1],keys[i]) > 0) {
+            qsort(keys,size,sizeof(void*),compar);
+            return;
+        }
     }
-    return 0;
 }
-static void tree_node_do_split(struct tree_node* node,struct tree_node* parent,struct key_info* info)
+static void tree_node_delete(struct tree_node* node,destructor dstor,struct tree_node_pool* pool)
 {
-    /* this procedure assumes that the caller has ensured that 'node' is a 4-node */
-    int i, j;
+    /* call the user-provided destructor (if any) on each key object in the subtree
+       and return its nodes to 'pool' (if not NULL: a private pool is released all
+       at once instead) */
+    int i;
+    if (dstor != NULL)
+        for (i = 0;i < 3;++i)
+            if (node->keys[i] != NULL)
+                (*dstor)(node->keys[i]);
+    for (i = 0;i < 4;++i)
+        if (node->children[i] != NULL)
+            tree_node_delete(node->children[i],dstor,pool);
+    if (pool != NULL)
+        tree_node_free(pool,node);
+}
+static void tree_node_insert_at(struct tree_node* node,int index,void* key,uint64_t norm,struct tree_node* left,struct tree_node* right,int wide)
+{
+    /* put 'key' (with prefix 'norm' if the node is 'wide') at position 'index' with
+       subtrees 'left' and 'right' (which replace the child at 'index'); the node
+       may become a 4-node */
+    int i;
+    for (i = 2;i > index;--i)
+        tree_node_set_key(node,i,node,i-1,wide);
+    for (i = 3;i > index+1;--i)
+        node->children[i] = node->children[i-1];
+    if (wide)
+        tree_node_norms(node)[index] = norm;
+    node->keys[index] = key;
+    node->children[index] = left;
+    node->children[index+1] = right;
+}
+static void tree_node_do_split(struct tree_node* node,struct tree_node* parent,int index,struct key_info* info)
+{
+    /* this procedure assumes that the caller has ensured that 'node' is a 4-node
+       and that it is the child at 'index' in 'parent' */
+    int i, j, wide;
+    void* median;
+    uint64_t mnorm;
     struct tree_node* newnode;
-    struct key_impl_info insinfo; /* insinfo.key is median key value */
+    wide = info->pool->wide;
     /* the node is already sorted, so choose keys[1] as the median */
-    insinfo.key = node->keys[1];
+    median = node->keys[1];
+    mnorm = wide ? tree_node_norms(node)[1] : 0;
     /* 'newnode' is going to be the right value; assign children from old node to it; overwrite
        children and keys in 'node' with NULLs so that it becomes a 2-node, thus making 'node'
        the left value */
-    newnode = malloc(sizeof(struct tree_node));
-    tree_node_init(newnode);
-    newnode->keys[0] = node->keys[2];
+    newnode = tree_node_new(info->pool);
+    tree_node_set_key(newnode,0,node,2,wide);
     for (i = 0,j = 2;i <= 1;++i,++j) {
         newnode->children[i] = node->children[j];
         node->children[j] = NULL;
     }
     for (i = 1;i <= 2;++i)
         node->keys[i] = NULL;
-    /* insert the node up into the parent; insertion should succeed because split value should not exist in parent */
-    insinfo.keyinfo = info;
-    tree_node_insert_key(parent,&insinfo,node,newnode);
-}
-static void* tree_node_delete_key(struct tree_node* node,struct key_impl_info* info,int index)
-{
-    /* assume that 'node->keys[index]' exists; this procedure leaves a hole
-       in a leave node in some subtree of 'node' to be fixed later; return 
-       the search key for the caller if a hole was placed */
-    void* swapKey;
-    struct tree_node* n;
-    void* k;
-    swapKey = NULL;
-    /* make 'n' point to right subtree; use k to save key to delete */
-    n = node->children[index+1];
-    k = node->keys[index];
-    /* handle case where 'node' is a leaf */
-    if (n == NULL) {
-        if (node->keys[1] != NULL) {
-            /* remove key from 3-node */
-            node->keys[index] = node->keys[index+1];
-            node->keys[index+1] = NULL;
-        }
-        else {
-            /* leave hole */
-            node->keys[index] = NULL;
-            swapKey = info->key;
-        }
-    }
-    /* handle case where 'node' is internal; swap the key to delete with the next-greater key */
-    else {
-        /* find next-greatest key in tree by searching for smallest element
-           of the right subtree; 'n' refers to the root of this subtree */
-        while (n->children[0] != NULL)
-            n = n->children[0];
-        /* if 'n' now points to a leaf node; take its least-ordered key and assign it to the node;
-           if 'n' is a 3-node, shift the greater-ordered element over; else if 'n' is a 2-node,
-           leave a hole to be fixed later */
-        node->keys[index] = n->keys[0];
-        if (n->keys[1] != NULL) {
-            n->keys[0] = n->keys[1];
-            n->keys[1] = NULL;
-        }
-        else {
-            /* leave hole */
-            n->keys[0] = NULL;
-            swapKey = node->keys[index];
-        }
-    }
-    /* delete the key 'k': call its destructor if it was specified */
-    if (info->keyinfo->dstor != NULL)
-        (*info->keyinfo->dstor)(k);
-    return swapKey;
+    /* split the subtree count; the median key moves up into the parent, whose
+       own count does not change */
+    newnode->size = 1 + tree_node_size(newnode->children[0]) + tree_node_size(newnode->children[1]);
+    node->size -= newnode->size + 1;
+    /* insert the median up into the parent */
+    tree_node_insert_at(parent,index,median,mnorm,node,newnode,wide);
+    tree_node_track(parent,info);
+    tree_node_track(newnode,info);
 }
-static void tree_node_remove_key(struct tree_node* node,int keyIndex,int childIndex)
+static void tree_node_remove_key(struct tree_node* node,int keyIndex,int childIndex,int wide)
 {
     int i, j;
     for (i = keyIndex,j = keyIndex+1;j < 3;++i,++j)
-        node->keys[i] = node->keys[j];
+        tree_node_set_key(node,i,node,j,wide);
     for (i = childIndex,j = childIndex+1;j < 4;++i,++j)
         node->children[i] = node->children[j];
 }
-static void tree_node_do_fix(struct tree_node* node,struct tree_node* parent)
+static void tree_node_do_fix(struct tree_node* node,struct tree_node* parent,int ni,struct treemap_cow* cow,struct tree_node_pool* pool)
 {
-    /* this procedure assumes that the caller has ensured that 'node' is a hole */
+    /* this procedure assumes that the caller has ensured that 'node' is a hole
+       and that it is the child at 'ni' in 'parent'; a sibling is made unshared
+       before it is changed (see tree_node_own) */
     int i;
-    int ni;
     int bound;
-    ni = 0;
-    while (parent->children[ni] != node)
-        ++ni;
     if (parent->keys[1] != NULL)
         bound = 2;
     else
         bound = 1;
     /* see if immediate right sibling is a 3-node */
     if (ni<bound && parent->children[(i = ni+1)]->keys[1] != NULL) {
+        tree_node_own(parent->children + i,cow,pool);
         /* separator in parent is at index 'ni' */
-        node->keys[0] = parent->keys[ni];
-        parent->keys[ni] = parent->children[i]->keys[0];
+        tree_node_set_key(node,0,parent,ni,pool->wide);
+        tree_node_set_key(parent,ni,parent->children[i],0,pool->wide);
         node->children[1] = parent->children[i]->children[0];
-        tree_node_remove_key(parent->children[i],0,0);
+        tree_node_remove_key(parent->children[i],0,0,pool->wide);
+        tree_node_update(node);
+        tree_node_update(parent->children[i]);
     }
     /* see if immediate left sibling is a 3-node */
     else if (ni>0 && parent->children[(i = ni-1)]->keys[1] != NULL) {
+        tree_node_own(parent->children + i,cow,pool);
         /* separator in parent is at index i */
-        node->keys[0] = parent->keys[i];
-        parent->keys[i] = parent->children[i]->keys[1];
+        tree_node_set_key(node,0,parent,i,pool->wide);
+        tree_node_set_key(parent,i,parent->children[i],1,pool->wide);
         node->children[1] = node->children[0]; /* need to shift this over */
         node->children[0] = parent->children[i]->children[2];
-        tree_node_remove_key(parent->children[i],1,2);
+        tree_node_remove_key(parent->children[i],1,2,pool->wide);
+        tree_node_update(node);
+        tree_node_update(parent->children[i]);
     }
     /* any immediate siblings are 2-nodes */
     else {
@@ -280,26 +516,208 @@ static void tree_node_do_fix(struct tree_node* node,struct tree_node* parent)
             left = 0;
             right = 1;
         }
+        tree_node_own(parent->children + (left == ni ? right : left),cow,pool);
         if (parent->children[left]->keys[0] != NULL) {
             /* left is 2-node; right is hole */
-            parent->children[left]->keys[1] = parent->keys[left];
+            tree_node_set_key(parent->children[left],1,parent,left,pool->wide);
             parent->children[left]->children[2] = parent->children[right]->children[0];
         }
         else {
             /* left is hole; right is 2-node */
-            parent->children[left]->keys[0] = parent->keys[left];
-            parent->children[left]->keys[1] = parent->children[right]->keys[0];
+            tree_node_set_key(parent->children[left],0,parent,left,pool->wide);
+            tree_node_set_key(parent->children[left],1,parent->children[right],0,pool->wide);
             for (i = 0;i<2;++i)
                 parent->children[left]->children[i+1] = parent->children[right]->children[i];
         }
+        parent->children[left]->size += parent->children[right]->size + 1;
         /* delete the right child node */
-        free(parent->children[right]);
+        tree_node_free(pool,parent->children[right]);
         parent->children[right] = NULL;
         /* remove the separator from the parent; shift children over from positions >right */
-        tree_node_remove_key(parent,left,right);
+        tree_node_remove_key(parent,left,right,pool->wide);
         /* parent may now be a hole node */
     }
 }
+static int tree_node_height(struct tree_node* node)
+{
+    /* the number of levels in the subtree (zero if it is empty) */
+    int height = 0;
+    while (node != NULL) {
+        ++height;
+        node = node->children[0];
+    }
+    return height;
+}
+static struct tree_node* tree_node_clone(struct tree_node* node,key_normalizer normalizer,struct tree_node_pool* pool)
+{
+    /* copy the subtree rooted at 'node' into 'pool', computing the prefixes of its
+       keys with 'normalizer' if it is not NULL */
+    int i;
+    struct tree_node* copy;
+    copy = tree_node_new(pool);
+    for (i = 0;i < 3 && node->keys[i] != NULL;++i) {
+        copy->keys[i] = node->keys[i];
+        if (normalizer != NULL)
+            tree_node_norms(copy)[i] = (*normalizer)(node->keys[i]);
+    }
+    for (i = 0;i < 4 && node->children[i] != NULL;++i)
+        copy->children[i] = tree_node_clone(node->children[i],normalizer,pool);
+    copy->size = node->size;
+    return copy;
+}
+static struct tree_node* tree_node_join(struct tree_node* left,int hl,void* key,uint64_t norm,struct tree_node* right,int hr,
+    int* height,struct treemap_cow* cow,struct key_info* info)
+{
+    /* join two trees of heights 'hl' and 'hr' (either may be empty) with 'key'
+       between them (every key in 'left' is less than it and every key in 'right'
+       greater); the key is inserted with the shorter tree as its subtree into the
+       spine of the taller tree at the level where the heights match, and 4-nodes
+       are split going back up the spine, so the cost is O(|hl-hr| + 1); return the
+       new root and store its height in '*height' */
+    int i, n, depth, wide;
+    int index[TREEMAP_MAX_HEIGHT];
+    struct tree_node* path[TREEMAP_MAX_HEIGHT];
+    struct tree_node* root, *node, **link;
+    wide = info->pool->wide;
+    if (hl == hr) {
+        node = tree_node_new(info->pool);
+        tree_node_insert_at(node,0,key,norm,left,right,wide);
+        node->size = 1 + tree_node_size(left) + tree_node_size(right);
+        *height = hl + 1;
+        return node;
+    }
+    /* follow the right spine of 'left' or the left spine of 'right' down to the
+       node whose children have the height of the other tree */
+    root = hl > hr ? left : right;
+    link = &root;
+    depth = 0;
+    for (i = hl > hr ? hl : hr;;--i) {
+        node = tree_node_own(link,cow,info->pool);
+        path[depth] = node;
+        index[depth++] = hl > hr ? tree_node_key_count(node) : 0;
+        if (i == (hl > hr ? hr : hl) + 1)
+            break;
+        link = node->children + index[depth-1];
+    }
+    n = index[depth-1];
+    if (hl > hr)
+        tree_node_insert_at(node,n,key,norm,node->children[n],right,wide);
+    else
+        tree_node_insert_at(node,0,key,norm,left,node->children[0],wide);
+    n = 1 + tree_node_size(hl > hr ? right : left);
+    for (i = 0;i < depth;++i)
+        path[i]->size += n;
+    *height = hl > hr ? hl : hr;
+    while (--depth >= 0 && path[depth]->keys[2] != NULL) {
+        if (depth == 0) {
+            struct tree_node* parent;
+            parent = tree_node_new(info->pool);
+            parent->size = path[0]->size;
+            root = parent;
+            tree_node_do_split(path[0],parent,0,info);
+            ++*height;
+        }
+        else
+            tree_node_do_split(path[depth],path[depth-1],index[depth-1],info);
+    }
+    return root;
+}
+struct tree_split
+{
+    /* the result of tree_node_split */
+    struct tree_node* left, *right;
+    int hl, hr;
+    void* key; /* the key equal to the split key or NULL */
+    uint64_t norm;
+};
+static void tree_node_split(struct tree_node* node,int height,const void* key,const uint64_t* norm,
+    struct tree_split* split,struct treemap_cow* cow,struct key_info* info)
+{
+    /* split the tree rooted at 'node' (of 'height' levels) into a tree of the keys
+       less than 'key' and a tree of those greater than it; the nodes on the path
+       down to 'key' are taken apart and the subtrees hanging off that path are
+       joined back together on either side, which costs O(height) in all since
+       each join on the way up costs the difference in height of its operands */
+    int i, j, n, wide, found;
+    void* keys[2];
+    uint64_t norms[2];
+    struct tree_node* children[3];
+    split->key = NULL;
+    if (node == NULL) {
+        split->left = split->right = NULL;
+        split->hl = split->hr = 0;
+        return;
+    }
+    wide = info->pool->wide;
+    node = tree_node_own(&node,cow,info->pool);
+    n = tree_node_key_count(node);
+    found = 0;
+    for (i = 0;i < n;++i) {
+        int cmp = tree_node_compare(node,i,key,norm,info->compar);
+        if (cmp == 0)
+            found = 1;
+        if (cmp <= 0)
+            break;
+    }
+    /* take the node apart; its children are now referred to from here */
+    n = tree_node_key_count(node);
+    for (j = 0;j < n;++j) {
+        keys[j] = node->keys[j];
+        norms[j] = wide ? tree_node_norms(node)[j] : 0;
+    }
+    for (j = 0;j <= n;++j)
+        children[j] = node->children[j];
+    tree_node_free(info->pool,node);
+    if (found) {
+        split->key = keys[i];
+        split->norm = norms[i];
+        split->left = children[i];
+        split->right = children[i+1];
+        split->hl = split->hr = height - 1;
+    }
+    else
+        tree_node_split(children[i],height-1,key,norm,split,cow,info);
+    /* join back the keys and subtrees on either side of the path */
+    for (j = i-1;j >= 0;--j)
+        split->left = tree_node_join(children[j],height-1,keys[j],norms[j],split->left,split->hl,&split->hl,cow,info);
+    for (j = i+found;j < n;++j)
+        split->right = tree_node_join(split->right,split->hr,keys[j],norms[j],children[j+1],height-1,&split->hr,cow,info);
+}
+
+/* tree_node_pool */
+struct tree_node_pool* tree_node_pool_new()
+{
+    struct tree_node_pool* pool;
+    pool = malloc(sizeof(struct tree_node_pool));
+    if (pool == NULL)
+        return NULL;
+    tree_node_pool_init(pool);
+    return pool;
+}
+void tree_node_pool_free(struct tree_node_pool* pool)
+{
+    if (pool != NULL) {
+        tree_node_pool_delete(pool);
+        free(pool);
+    }
+}
+void tree_node_pool_init(struct tree_node_pool* pool)
+{
+    pool->slabs = NULL;
+    pool->free = NULL;
+    pool->wide = 0;
+}
+void tree_node_pool_delete(struct tree_node_pool* pool)
+{
+    /* release every node in the pool, including those still in use */
+    struct tree_node_slab* slab, *next;
+    for (slab = pool->slabs;slab != NULL;slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    pool->slabs = NULL;
+    pool->free = NULL;
+}
 
 /* treemap */
 struct treemap* treemap_new(key_comparator compar,destructor dstor)
@@ -311,6 +729,15 @@ struct treemap* treemap_new(key_comparator compar,destructor dstor)
     treemap_init(treemap,compar,dstor);
     return treemap;
 }
+struct treemap* treemap_new_pool(key_comparator compar,destructor dstor,struct tree_node_pool* pool)
+{
+    struct treemap* treemap;
+    treemap = malloc(sizeof(struct treemap));
+    if (treemap == NULL)
+        return NULL;
+    treemap_init_pool(treemap,compar,dstor,pool);
+    return treemap;
+}
 struct treemap* treemap_new_ex(key_comparator compar,destructor dstor,void** keys,int size)
 {
     struct treemap* treemap;
@@ -320,6 +747,15 @@ struct treemap* treemap_new_ex(key_comparator compar,destructor dstor,void** key
     treemap_init_ex(treemap,compar,dstor,keys,size);
     return treemap;
 }
+struct treemap* treemap_new_persistent(key_comparator compar,destructor dstor)
+{
+    struct treemap* treemap;
+    treemap = malloc(sizeof(struct treemap));
+    if (treemap == NULL)
+        return NULL;
+    treemap_init_persistent(treemap,compar,dstor);
+    return treemap;
+}
 void treemap_free(struct treemap* treemap)
 {
     if (treemap != NULL) {
@@ -329,69 +765,205 @@ void treemap_free(struct treemap* treemap)
 }
 void treemap_init(struct treemap* treemap,key_comparator compar,destructor dstor)
 {
+    treemap_init_pool(treemap,compar,dstor,NULL);
+}
+void treemap_init_pool(struct treemap* treemap,key_comparator compar,destructor dstor,struct tree_node_pool* pool)
+{
+    /* if 'pool' is NULL then the map allocates nodes from a pool of its own */
     treemap->count = 0;
     treemap->root = NULL;
     treemap->compar = compar;
     treemap->dstor = dstor;
+    treemap->pool = pool;
+    tree_node_pool_init(&treemap->ownpool);
+    treemap->cow = NULL;
+    treemap->version = -1;
+    treemap->stamp = 0;
+    treemap->normalizer = NULL;
+}
+void treemap_init_persistent(struct treemap* treemap,key_comparator compar,destructor dstor)
+{
+    struct treemap_cow* cow;
+    treemap_init(treemap,compar,dstor);
+    cow = malloc(sizeof(struct treemap_cow));
+    pthread_mutex_init(&cow->lock,NULL);
+    cow->live = NULL;
+    cow->nlive = 0;
+    cow->livecap = 0;
+    atomic_init(&cow->oldest,INT64_MAX);
+    cow->version = 0;
+    atomic_init(&cow->garbage,NULL);
+    cow->retired = NULL;
+    cow->nretired = 0;
+    cow->retcap = 0;
+    treemap->cow = cow;
+}
+static inline struct tree_node_pool* treemap_pool(struct treemap* treemap)
+{
+    return treemap->pool != NULL ? treemap->pool : &treemap->ownpool;
+}
+static inline const uint64_t* treemap_norm(struct treemap* treemap,const void* key,uint64_t* norm)
+{
+    /* store the normalized prefix of 'key' in '*norm' and return 'norm', or NULL
+       if the map has no normalizer */
+    if (treemap->normalizer == NULL)
+        return NULL;
+    *norm = (*treemap->normalizer)(key);
+    return norm;
+}
+int treemap_set_normalizer(struct treemap* treemap,key_normalizer normalizer)
+{
+    /* the map must be empty and its pool wide: a private pool is made wide (any
+       nodes left in it are released) and so is a shared pool that has not yet
+       allocated any nodes; return non-zero if this is not possible */
+    struct tree_node_pool* pool;
+    if (treemap->root != NULL || treemap->version >= 0)
+        return 1;
+    pool = treemap_pool(treemap);
+    if (normalizer != NULL && !pool->wide) {
+        if (pool->slabs != NULL) {
+            /* nodes may remain in use by other maps or by snapshots */
+            if (pool != &treemap->ownpool || (treemap->cow != NULL
+                    && atomic_load_explicit(&treemap->cow->oldest,memory_order_acquire) != INT64_MAX))
+                return 1;
+            tree_node_pool_delete(pool);
+        }
+        pool->wide = 1;
+    }
+    treemap->normalizer = normalizer;
+    return 0;
 }
-static void treemap_init_ex_recursive(struct tree_node** nodes,int size,void*** level)
+static void treemap_collect(struct treemap* treemap)
 {
+    /* (writer) return nodes released by other threads to the pool and destroy
+       retired keys that no live snapshot can hold any more */
     int i, j;
-    struct dynamic_array* arr;
-    if (*(level-1) != NULL)
-        /* at internal level: prepare queue for child nodes */
-        arr = dynamic_array_new_ex(size*2);
-    else
-        /* at leaf level: nodes have no children */
-        arr = NULL;
-    for (i = 0,j = 0;i < size;++i) {
-        int k;
-        k = 0;
-        /* place keys into the node; a NULL value acts as the terminator for any
-           node's keys; allow the node to become up to a 4-node */
-        while (k < 3) {
-            if ((*level)[j] == NULL) {
-                ++j;
-                break;
-            }
-            nodes[i]->keys[k++] = (*level)[j++];
-        }
-        /* create the node's children according to tree behavior; allow up to 4 children
-           for 4-nodes */
-        if (arr != NULL) {
-            k = 0;
-            while (k<2 || (k<4 && nodes[i]->keys[k-1]!=NULL)) {
-                struct tree_node* n;
-                n = malloc(sizeof(struct tree_node));
-                dynamic_array_pushback(arr,n);
-                tree_node_init(n);
-                nodes[i]->children[k++] = n;
-            }
+    int64_t oldest;
+    struct treemap_cow* cow = treemap->cow;
+    struct tree_node* node, *next;
+    if (atomic_load_explicit(&cow->garbage,memory_order_relaxed) != NULL) {
+        node = atomic_exchange_explicit(&cow->garbage,NULL,memory_order_acquire);
+        while (node != NULL) {
+            next = node->children[0];
+            tree_node_free(&treemap->ownpool,node);
+            node = next;
         }
     }
-    if (arr != NULL) {
-        /* recursively construct the next level (down the array) */
-        treemap_init_ex_recursive((struct tree_node**)arr->da_data,arr->da_top,level-1);
-        dynamic_array_free(arr);
+    if (cow->nretired == 0)
+        return;
+    oldest = atomic_load_explicit(&cow->oldest,memory_order_acquire);
+    for (i = 0;i < cow->nretired && cow->retired[i].version <= oldest;++i)
+        (*treemap->dstor)(cow->retired[i].key);
+    if (i > 0) {
+        for (j = 0;i < cow->nretired;++i,++j)
+            cow->retired[j] = cow->retired[i];
+        cow->nretired = j;
     }
 }
+static void treemap_retire(struct treemap* treemap,void* key)
+{
+    /* (writer) destroy a removed key, or defer that if a snapshot taken before
+       the removal is still live */
+    struct treemap_cow* cow = treemap->cow;
+    if (atomic_load_explicit(&cow->oldest,memory_order_acquire) >= cow->version) {
+        (*treemap->dstor)(key);
+        return;
+    }
+    if (cow->nretired >= cow->retcap) {
+        cow->retcap = cow->retcap == 0 ? 16 : cow->retcap * 2;
+        cow->retired = realloc(cow->retired,sizeof(struct treemap_retired) * cow->retcap);
+    }
+    cow->retired[cow->nretired].key = key;
+    cow->retired[cow->nretired++].version = cow->version;
+}
+static void treemap_own_path(struct treemap* treemap,struct tree_node** path,int* index,int depth)
+{
+    /* make the nodes on a recorded path unshared (from the root down) so that the
+       writer may modify them; 'path' is updated with any copies */
+    int i;
+    struct tree_node_pool* pool = &treemap->ownpool;
+    if (treemap->cow == NULL)
+        return;
+    path[0] = tree_node_own(&treemap->root,treemap->cow,pool);
+    for (i = 1;i < depth;++i)
+        path[i] = tree_node_own(path[i-1]->children + index[i-1],treemap->cow,pool);
+}
+struct treemap* treemap_snapshot(struct treemap* treemap)
+{
+    /* return an immutable version of the persistent map 'treemap' as it is now,
+       or NULL if 'treemap' is not persistent */
+    struct treemap* snapshot;
+    struct treemap_cow* cow = treemap->cow;
+    if (cow == NULL || treemap->version >= 0)
+        return NULL;
+    snapshot = malloc(sizeof(struct treemap));
+    if (snapshot == NULL)
+        return NULL;
+    treemap_init(snapshot,treemap->compar,NULL);
+    /* the shared nodes already hold the prefixes, so searches can use them */
+    snapshot->normalizer = treemap->normalizer;
+    snapshot->count = treemap->count;
+    snapshot->root = treemap->root;
+    if (snapshot->root != NULL)
+        atomic_fetch_add_explicit(&snapshot->root->refs,1,memory_order_relaxed);
+    snapshot->cow = cow;
+    snapshot->version = cow->version++;
+    pthread_mutex_lock(&cow->lock);
+    if (cow->nlive >= cow->livecap) {
+        cow->livecap = cow->livecap == 0 ? 8 : cow->livecap * 2;
+        cow->live = realloc(cow->live,sizeof(int64_t) * cow->livecap);
+    }
+    cow->live[cow->nlive++] = snapshot->version;
+    if (cow->nlive == 1)
+        atomic_store_explicit(&cow->oldest,snapshot->version,memory_order_release);
+    pthread_mutex_unlock(&cow->lock);
+    return snapshot;
+}
+static void treemap_snapshot_release(struct treemap* snapshot)
+{
+    int i;
+    struct treemap_cow* cow = snapshot->cow;
+    if (snapshot->root != NULL)
+        tree_node_release(snapshot->root,cow,NULL);
+    pthread_mutex_lock(&cow->lock);
+    for (i = 0;cow->live[i] != snapshot->version;++i)
+        ;
+    for (--cow->nlive;i < cow->nlive;++i)
+        cow->live[i] = cow->live[i+1];
+    atomic_store_explicit(&cow->oldest,cow->nlive > 0 ? cow->live[0] : INT64_MAX,memory_order_release);
+    pthread_mutex_unlock(&cow->lock);
+}
+static void treemap_build(struct treemap* treemap,void** keys,int size)
+{
+    /* replace the (empty) tree with one built from the sorted, distinct keys */
+    int height;
+    struct tree_node_pool* pool;
+    treemap->root = NULL;
+    treemap->count = size;
+    ++treemap->stamp;
+    if (size <= 0)
+        return;
+    pool = treemap_pool(treemap);
+    height = tree_height(size);
+    tree_node_reserve(pool,tree_node_build_count(size,height));
+    treemap->root = tree_node_build(keys,size,height,treemap->normalizer,pool);
+}
 void treemap_init_ex(struct treemap* treemap,key_comparator compar,destructor dstor,void** keys,int size)
 {
     /* 'keys' must be an array of pointers of size 'size' that point to
        individual tree key structures allocated on the heap */
-    int i, j, k, sz;
+    int i, j, k;
     void** arr, *plast;
-    struct dynamic_array* levels;
+    treemap_init(treemap,compar,dstor);
     /* check size requirements */
-    treemap->count = size<0 ? 0 : size;
     if (size <= 0)
         return;
     /* we must ensure that the data is sorted */
-    qsort(keys,size,sizeof(void*),compar);
+    tree_keys_sort(keys,size,compar);
     /* copy key structures to the array 'arr' that will be used in the tree; disallow duplicate key values,
-       leaving them in array 'keys'; use NULL to terminate the arrays 'arr' and 'keys'; the user should check
+       leaving them in array 'keys'; use NULL to terminate the array 'keys'; the user should check
        'keys' after this call to see if any keys were left unused */
-    arr = malloc(sizeof(void*) * (size+1)); /* allocate 1 more for NULL terminator */
+    arr = malloc(sizeof(void*) * size);
     i = 0;
     j = 0;
     k = 0;
@@ -407,139 +979,256 @@ void treemap_init_ex(struct treemap* treemap,key_comparator compar,destructor ds
         ++i, ++j;
     }
     keys[k] = NULL;
-    arr[i] = NULL;
-    size = i;
-    /* construct the levels of the tree; store them in a dynamic array; put NULL as first element;
-       this will indicate the end for the implementation */
-    levels = dynamic_array_new();
-    dynamic_array_pushback(levels,NULL);
-    dynamic_array_pushback(levels,arr);
-    /* for each level: calculate the size of the new keys array; since keys are divided into groups of 3,
-       we can allocate size/3 number of key-value structures */
-    while ((sz = size / 3) > 0) {
-        void** prev;
-        /* cache the last level */
-        prev = arr;
-        /* add 2 to 'sz' so that we can: 1) store a terminating NULL pointer and 2) possibly
-           store an extra key given that size%3 == 2 */
-        sz += 2;
-        arr = malloc(sizeof(void*) * sz);
-        /* go through previous level; find the middle key of every 3-key pair; put it in 'arr';
-           size of 'arr' will be 'i' */
-        for (i = 0,j = 2;j < size;++i,j+=3) {
-            arr[i] = prev[j-1];
-            /* use NULL to separate keys */
-            prev[j-1] = NULL;
-        }
-        /* handle case where size%3 == 2 */
-        if (j == size) {
-            k = size-2;
-            arr[i++] = prev[k];
-            prev[k] = NULL;
-        }
-        arr[i] = NULL;
-        size = i;
-        /* push back the array into 'levels' */
-        dynamic_array_pushback(levels,arr);
-    }
-    /* construct the tree; first build the root node */
-    treemap->root = malloc(sizeof(struct tree_node));
-    treemap->compar = compar;
-    treemap->dstor = dstor;
-    tree_node_init(treemap->root);
-    treemap_init_ex_recursive(&treemap->root,1,(void***)(levels->da_data + levels->da_top - 1));
-    /* free allocated memory */
-    dynamic_array_free_ex(levels,&free);
+    /* construct the tree from a single block of nodes */
+    treemap_build(treemap,arr,i);
+    free(arr);
 }
 void treemap_delete(struct treemap* treemap)
 {
-    if (treemap->root != NULL) {
-        if (treemap->dstor != NULL)
-            tree_node_delete_dstor(treemap->root,treemap->dstor);
-        else
-            tree_node_delete(treemap->root);
-        free(treemap->root);
+    /* nodes from a private pool need not be visited unless there are keys to
+       destroy: the whole pool is released at once */
+    if (treemap->version >= 0) {
+        treemap_snapshot_release(treemap);
+        treemap->root = NULL;
+        treemap->count = 0;
+        ++treemap->stamp;
+        return;
+    }
+    if (treemap->cow != NULL) {
+        /* no snapshot is live, so every retired key can go */
+        struct treemap_cow* cow = treemap->cow;
+        int i;
+        for (i = 0;i < cow->nretired;++i)
+            (*treemap->dstor)(cow->retired[i].key);
+        pthread_mutex_destroy(&cow->lock);
+        free(cow->live);
+        free(cow->retired);
+        free(cow);
+        treemap->cow = NULL;
     }
+    if (treemap->root != NULL && (treemap->pool != NULL || treemap->dstor != NULL))
+        tree_node_delete(treemap->root,treemap->dstor,treemap->pool);
+    tree_node_pool_delete(&treemap->ownpool);
+    treemap->root = NULL;
+    treemap->count = 0;
+    ++treemap->stamp;
 }
-static int treemap_insert_recursive(struct tree_node** node,struct tree_node* parent,struct key_impl_info* info)
+static void* treemap_cursor_seek(struct treemap_cursor* cursor,const void* key,int strict,int depth);
+static int treemap_cursor_climb(struct treemap_cursor* cursor,const void* key,const uint64_t* norm);
+static void** treemap_insert_generic(struct treemap* treemap,void* key,int track,int* inserted,struct treemap_cursor* finger)
 {
-    struct tree_node* n;
-    n = *node;
-    if (n->children[0] != NULL) {
-        /* 'node' is an internal node, which means it is at least
-           a 2-node; recursively search for a leaf */
-        int cmp;
-        cmp = (*info->keyinfo->compar)(info->key,n->keys[0]);
-        /* if 'key' already exists, return with error status */
-        if (cmp == 0)
-            return 1;
-        if (cmp < 0) {
-            /* 'key' is less than first key in node; visit left subtree */
-            if (treemap_insert_recursive(n->children,n,info) == 1)
-                return 1;
+    /* insert 'key' unless an equal key exists; if 'track' is non-zero then return
+       the slot holding the key that is in the tree afterwards; the descent records
+       its path so that the splits can then be carried out going back up it; if
+       'finger' is not NULL then the path is recorded in it (the descent starting
+       where treemap_cursor_climb says) and it is left at the key */
+    int i, n, depth;
+    int pathindex[TREEMAP_MAX_HEIGHT];
+    struct tree_node* pathnodes[TREEMAP_MAX_HEIGHT];
+    int* index = pathindex;
+    struct tree_node** path = pathnodes;
+    struct tree_node* node;
+    struct key_info kinfo;
+    uint64_t nbuf;
+    const uint64_t* norm;
+    *inserted = 0;
+    if (treemap->cow != NULL)
+        treemap_collect(treemap);
+    norm = treemap_norm(treemap,key,&nbuf);
+    /* if the root is null, create the first node */
+    if (treemap->root == NULL) {
+        treemap->root = tree_node_new(treemap_pool(treemap));
+        if (norm != NULL)
+            tree_node_norms(treemap->root)[0] = *norm;
+        treemap->root->keys[0] = key;
+        treemap->root->size = 1;
+        ++treemap->count;
+        ++treemap->stamp;
+        *inserted = 1;
+        if (finger != NULL) {
+            finger->treemap = treemap;
+            treemap_cursor_seek(finger,key,0,0);
         }
-        else if (n->keys[1] != NULL) {
-            /* 'node' is a 3-node */
-            cmp = (*info->keyinfo->compar)(info->key,n->keys[1]);
-            if (cmp == 0)
-                return 1;
-            if (cmp < 0) {
-                /* key is less than second key (greater than first); visit middle subtree */
-                if (treemap_insert_recursive(n->children+1,n,info) == 1)
-                    return 1;
-            }
-            else {
-                /* key is greater than first and second keys; visit right subtree */
-                if (treemap_insert_recursive(n->children+2,n,info) == 1)
-                    return 1;
-            }
+        return treemap->root->keys;
+    }
+    depth = 0;
+    node = treemap->root;
+    if (finger != NULL) {
+        if (finger->treemap != treemap) {
+            finger->treemap = treemap;
+            finger->depth = 0;
         }
-        else {
-            /* key is greater than first key; visit right (middle) subtree */
-            if (treemap_insert_recursive(n->children+1,n,info) == 1)
-                return 1;
+        path = finger->nodes;
+        index = finger->index;
+        depth = treemap_cursor_climb(finger,key,norm);
+        if (depth > 0)
+            node = path[depth];
+        finger->depth = 0;
+    }
+    while (1) {
+        n = tree_node_key_count(node);
+        for (i = 0;i < n;++i) {
+            int cmp = tree_node_compare(node,i,key,norm,treemap->compar);
+            /* if 'key' already exists, return with error status; a slot that is
+               handed out must be in an unshared node */
+            if (cmp == 0) {
+                path[depth] = node;
+                index[depth++] = i;
+                if (track && treemap->cow != NULL) {
+                    treemap_own_path(treemap,path,index,depth);
+                    node = path[depth-1];
+                    ++treemap->stamp;
+                }
+                if (finger != NULL) {
+                    finger->depth = depth;
+                    finger->stamp = treemap->stamp;
+                }
+                return node->keys + i;
+            }
+            if (cmp < 0)
+                break;
         }
+        path[depth] = node;
+        index[depth++] = i;
+        if (node->children[0] == NULL)
+            break;
+        node = node->children[i];
     }
+    kinfo.compar = treemap->compar;
+    kinfo.dstor = treemap->dstor;
+    kinfo.pool = treemap_pool(treemap);
+    kinfo.track = track ? key : NULL;
+    kinfo.slot = NULL;
     /* 'node' is a leaf node; insert the key into it */
-    else if (tree_node_insert_key(n,info,NULL,NULL) == 1)
-        return 1;
-    /* test if 'node' is now a 4-node, in which case it needs to be split */
-    if (n->keys[2] != NULL) {
-        /* if 'parent' is NULL, then 'node' is the root; we need to create a new root node */
-        if (parent == NULL) {
-            parent = malloc(sizeof(struct tree_node));
-            tree_node_init(parent);
-            /* assign the new root */
-            *node = parent;
-        }
-        tree_node_do_split(n,parent,info->keyinfo);
-    }
-    /* return success status */
-    return 0;
+    if (treemap->cow != NULL) {
+        treemap_own_path(treemap,path,index,depth);
+        node = path[depth-1];
+    }
+    tree_node_insert_at(node,i,key,norm != NULL ? *norm : 0,NULL,NULL,kinfo.pool->wide);
+    tree_node_track(node,&kinfo);
+    for (i = 0;i < depth;++i)
+        ++path[i]->size;
+    /* split 4-nodes going back up the path; if the root splits then a new root is
+       created above it */
+    while (--depth >= 0 && path[depth]->keys[2] != NULL) {
+        struct tree_node* parent;
+        if (depth == 0) {
+            parent = tree_node_new(kinfo.pool);
+            parent->size = path[0]->size;
+            treemap->root = parent;
+            tree_node_do_split(path[0],parent,0,&kinfo);
+        }
+        else
+            tree_node_do_split(path[depth],path[depth-1],index[depth-1],&kinfo);
+    }
+    ++treemap->count;
+    ++treemap->stamp;
+    *inserted = 1;
+    /* the path above the highest node that changed still leads to the key */
+    if (finger != NULL)
+        treemap_cursor_seek(finger,key,0,depth > 0 ? depth : 0);
+    return kinfo.slot;
 }
 int treemap_insert(struct treemap* treemap,void* key)
 {
     /* the user owns 'key' until we successfully add it to the tree;
        if the insert operation fails then the user is responsible for it */
-    struct key_info kinfo;
-    struct key_impl_info info;
-    /* if the root is null, create the first node */
-    if (treemap->root == NULL) {
-        treemap->root = malloc(sizeof(struct tree_node));
-        tree_node_init(treemap->root);
-        treemap->root->keys[0] = key;
-        ++treemap->count;
+    int inserted;
+    treemap_insert_generic(treemap,key,0,&inserted,NULL);
+    return inserted ? 0 : 1;
+}
+void** treemap_find_or_insert(struct treemap* treemap,void* key,int* inserted)
+{
+    /* return the slot that holds the key equal to 'key'; if there was none then
+       'key' itself is inserted and '*inserted' is set; the caller may then store
+       a different key in the slot as long as it compares the same (for example a
+       heap copy of a stack key); the slot is only valid until the tree is next
+       modified */
+    return treemap_insert_generic(treemap,key,1,inserted,NULL);
+}
+int treemap_insert_hint(struct treemap* treemap,void* key,struct treemap_cursor* finger)
+{
+    /* like treemap_insert but the search starts from the position of 'finger'
+       (see treemap_lookup_hint), which is left at the key equal to 'key' */
+    int inserted;
+    treemap_insert_generic(treemap,key,0,&inserted,finger);
+    return inserted ? 0 : 1;
+}
+static void treemap_flatten(struct tree_node* node,void** out,int* n)
+{
+    int i;
+    for (i = 0;i < 3 && node->keys[i] != NULL;++i) {
+        if (node->children[i] != NULL)
+            treemap_flatten(node->children[i],out,n);
+        out[(*n)++] = node->keys[i];
+    }
+    if (node->children[i] != NULL)
+        treemap_flatten(node->children[i],out,n);
+}
+int treemap_insert_sorted(struct treemap* treemap,void** keys,int size)
+{
+    /* insert a batch of keys (which is sorted first unless it is in order already)
+       and return the number of keys inserted; keys that compare equal to a key in
+       the tree or to an earlier key in the batch are not inserted: they are moved
+       to the front of 'keys' and remain the caller's responsibility; a batch that
+       is large compared to the tree is merged with the tree's keys and the tree is
+       rebuilt in linear time, while a small batch is inserted key by key */
+    int i, j, m, n, rejected;
+    void** merged;
+    if (size <= 0)
         return 0;
+    if ((int64_t)size * TREEMAP_MERGE_RATIO < treemap->count) {
+        rejected = 0;
+        for (i = 0;i < size;++i)
+            if (treemap_insert(treemap,keys[i]) != 0)
+                keys[rejected++] = keys[i];
+        return size - rejected;
     }
-    kinfo.compar = treemap->compar;
-    kinfo.dstor = treemap->dstor;
-    info.key = key;
-    info.keyinfo = &kinfo;
-    /* recursively insert element into tree */
-    if (treemap_insert_recursive(&treemap->root,NULL,&info) == 1)
-        return 1;
-    ++treemap->count;
-    return 0;
+    tree_keys_sort(keys,size,treemap->compar);
+    n = 0;
+    merged = malloc(sizeof(void*) * ((size_t)treemap->count + size));
+    if (treemap->root != NULL) {
+        void** old = merged + size; /* the tree's keys occupy the tail of the array */
+        treemap_flatten(treemap->root,old,&n);
+        /* release the old nodes; a private pool belongs to this tree alone
+           unless snapshots share its nodes */
+        if (treemap->cow != NULL)
+            tree_node_release(treemap->root,treemap->cow,&treemap->ownpool);
+        else if (treemap->pool == NULL)
+            tree_node_pool_delete(&treemap->ownpool);
+        else
+            tree_node_delete(treemap->root,NULL,treemap->pool);
+        treemap->root = NULL;
+    }
+    /* merge into the front of 'merged'; the write position never overtakes the
+       unread part of the tree's keys, which start 'size' entries further on */
+    i = size;
+    j = 0;
+    m = 0;
+    rejected = 0;
+    while (j < size) {
+        int cmp;
+        if (i < size + n) {
+            cmp = (*treemap->compar)(merged[i],keys[j]);
+            if (cmp < 0) {
+                merged[m++] = merged[i++];
+                continue;
+            }
+            if (cmp == 0) {
+                keys[rejected++] = keys[j++];
+                continue;
+            }
+        }
+        if (m > 0 && (*treemap->compar)(merged[m-1],keys[j]) == 0)
+            keys[rejected++] = keys[j++];
+        else
+            merged[m++] = keys[j++];
+    }
+    while (i < size + n)
+        merged[m++] = merged[i++];
+    treemap_build(treemap,merged,m);
+    free(merged);
+    return size - rejected;
 }
 static void treemap_search_recursive(struct search_impl_info* info)
 {
@@ -549,7 +1238,7 @@ static void treemap_search_recursive(struct search_impl_info* info)
     int cmp;
     if (info->node == NULL)
         return;
-    cmp = (*info->info.keyinfo->compar)(info->info.key,info->node->keys[0]);
+    cmp = tree_node_compare(info->node,0,info->info.key,info->info.norm,info->info.keyinfo->compar);
     if (cmp == 0) {
         /* found key; mark which slot it's in */
         info->index = 0;
@@ -563,7 +1252,7 @@ static void treemap_search_recursive(struct search_impl_info* info)
     }
     if (info->node->keys[1] != NULL) {
         /* 'info->node' is a 3-node */
-        cmp = (*info->info.keyinfo->compar)(info->info.key,info->node->keys[1]);
+        cmp = tree_node_compare(info->node,1,info->info.key,info->info.norm,info->info.keyinfo->compar);
         if (cmp == 0) {
             /* found key; mark which slot it's in */
             info->index = 1;
@@ -591,79 +1280,740 @@ void* treemap_lookup(struct treemap* treemap,const void* key)
        that is currently in the tree */
     struct key_info kinfo;
     struct search_impl_info info;
+    uint64_t nbuf;
     kinfo.compar = treemap->compar;
     kinfo.dstor = treemap->dstor;
+    kinfo.track = NULL;
     info.node = treemap->root;
     info.info.key = (void*)key;
+    info.info.norm = treemap_norm(treemap,key,&nbuf);
     info.info.keyinfo = &kinfo;
     treemap_search_recursive(&info);
     if (info.node != NULL)
         return info.node->keys[info.index];
     return NULL;
 }
-static void treemap_repair_recursive(struct tree_node** node,struct tree_node* parent,struct key_impl_info* info)
+void* treemap_lookup_hint(struct treemap* treemap,const void* key,struct treemap_cursor* finger)
 {
-    /* recursive case: search for the hole */
-    if ((*node)->keys[0] != NULL ) {
-        if (info == NULL)
-            /* search for the hole at the bottom of the left subtree */
-            treemap_repair_recursive((*node)->children,(*node),NULL);
-        else {
-            /* search for the key */
-            int cmp;
-            cmp = (*info->keyinfo->compar)(info->key,(*node)->keys[0]);
-            if (cmp == 0)
-                /* found: search right subtree for successor slot */
-                treemap_repair_recursive((*node)->children+1,(*node),NULL);
-            else if (cmp < 0)
-                treemap_repair_recursive((*node)->children,(*node),info);
-            else if ((*node)->keys[1] != NULL) {
-                /* '*node' is a 3-node */
-                cmp = (*info->keyinfo->compar)(info->key,(*node)->keys[1]);
-                if (cmp == 0)
-                    /* found: search right subtree for successor slot */
-                    treemap_repair_recursive((*node)->children+2,(*node),NULL);
-                else if (cmp < 0)
-                    treemap_repair_recursive((*node)->children+1,(*node),info);
-                else
-                    treemap_repair_recursive((*node)->children+2,(*node),info);
-            }
-            else
-                treemap_repair_recursive((*node)->children+1,(*node),info);
-        }
-        if ((*node)->keys[0] != NULL)
-            return;
-    }
-    if (parent == NULL) {
-        /* root node is a hole-node; delete the root node and assign its sole
-           child as the new root */
-        parent = (*node);
-        *node = parent->children[0];
-        free(parent);
-    }
-    else {
-        /* base case: fix a hole */
-        tree_node_do_fix((*node),parent);
+    /* like treemap_lookup but the search climbs from the position of 'finger' to
+       the lowest node where 'key' belongs instead of starting at the root, and
+       'finger' is left at the least key not less than 'key'; a finger that is
+       not positioned (or was positioned before the tree was last modified) is
+       positioned by a search from the root */
+    void* found;
+    uint64_t nbuf;
+    int depth;
+    if (finger->treemap != treemap) {
+        finger->treemap = treemap;
+        finger->depth = 0;
     }
+    depth = treemap_cursor_climb(finger,key,treemap_norm(treemap,key,&nbuf));
+    found = treemap_cursor_seek(finger,key,0,depth);
+    if (found != NULL && (*treemap->compar)(found,key) != 0)
+        return NULL;
+    return found;
 }
-int treemap_remove(struct treemap* treemap,const void* key)
+void* treemap_replace(struct treemap* treemap,void* key)
 {
+    /* replace the key equal to 'key' with 'key' itself and return the key that
+       was replaced, or NULL if there was none (in which case nothing is inserted);
+       the old key's destructor is not called */
+    void* old;
     struct key_info kinfo;
     struct search_impl_info info;
+    uint64_t nbuf;
+    if (treemap->cow != NULL) {
+        /* the node holding the key is changed and so must be unshared: record
+           the path to it and own that path if the key is found */
+        int i, n, depth, found;
+        int index[TREEMAP_MAX_HEIGHT];
+        struct tree_node* path[TREEMAP_MAX_HEIGHT];
+        struct tree_node* node;
+        const uint64_t* norm;
+        treemap_collect(treemap);
+        norm = treemap_norm(treemap,key,&nbuf);
+        depth = 0;
+        found = 0;
+        node = treemap->root;
+        while (node != NULL) {
+            n = tree_node_key_count(node);
+            for (i = 0;i < n;++i) {
+                int cmp = tree_node_compare(node,i,key,norm,treemap->compar);
+                if (cmp == 0)
+                    found = 1;
+                if (cmp <= 0)
+                    break;
+            }
+            path[depth] = node;
+            index[depth++] = i;
+            if (found)
+                break;
+            node = node->children[i];
+        }
+        if (!found)
+            return NULL;
+        treemap_own_path(treemap,path,index,depth);
+        ++treemap->stamp;
+        node = path[depth-1];
+        old = node->keys[i];
+        node->keys[i] = key;
+        return old;
+    }
     kinfo.compar = treemap->compar;
     kinfo.dstor = treemap->dstor;
+    kinfo.track = NULL;
     info.node = treemap->root;
-    info.info.key = (void*)key;
+    info.info.key = key;
+    info.info.norm = treemap_norm(treemap,key,&nbuf);
     info.info.keyinfo = &kinfo;
     treemap_search_recursive(&info);
-    if (info.node != NULL) {
-        if ((info.info.key = tree_node_delete_key(info.node,&info.info,info.index)) != NULL)
-            /* repair tree if removal left hole in tree */
-            treemap_repair_recursive(&treemap->root,NULL,&info.info);
-        --treemap->count;
+    if (info.node == NULL)
+        return NULL;
+    old = info.node->keys[info.index];
+    info.node->keys[info.index] = key;
+    return old;
+}
+int treemap_remove(struct treemap* treemap,const void* key)
+{
+    /* find the key in a single descent that records the path; a key in an internal
+       node is swapped with its successor (the least key in its right subtree) so
+       that a key is always taken out of a leaf; if that leaves the leaf empty
+       then the hole is fixed going back up the path; in a persistent map the
+       path is unshared before anything on it changes */
+    int i, n, depth, found, top;
+    int index[TREEMAP_MAX_HEIGHT];
+    struct tree_node* path[TREEMAP_MAX_HEIGHT];
+    struct tree_node* node, *leaf;
+    struct tree_node_pool* pool;
+    void* removed;
+    uint64_t nbuf;
+    const uint64_t* norm;
+    if (treemap->cow != NULL)
+        treemap_collect(treemap);
+    norm = treemap_norm(treemap,key,&nbuf);
+    depth = 0;
+    found = 0;
+    node = treemap->root;
+    while (node != NULL) {
+        n = tree_node_key_count(node);
+        for (i = 0;i < n;++i) {
+            int cmp = tree_node_compare(node,i,key,norm,treemap->compar);
+            if (cmp == 0)
+                found = 1;
+            if (cmp <= 0)
+                break;
+        }
+        path[depth] = node;
+        index[depth++] = i;
+        if (found)
+            break;
+        node = node->children[i];
+    }
+    if (!found)
+        return 1;
+    removed = node->keys[i];
+    top = depth - 1;
+    if (node->children[0] != NULL) {
+        /* descend to the successor; the path takes the right subtree of the key */
+        index[depth-1] = i + 1;
+        leaf = node->children[i+1];
+        while (1) {
+            path[depth] = leaf;
+            index[depth++] = 0;
+            if (leaf->children[0] == NULL)
+                break;
+            leaf = leaf->children[0];
+        }
+    }
+    if (treemap->cow != NULL)
+        treemap_own_path(treemap,path,index,depth);
+    node = path[top];
+    leaf = path[depth-1];
+    if (leaf != node) {
+        tree_node_set_key(node,i,leaf,0,treemap_pool(treemap)->wide);
+        i = 0;
+    }
+    /* take the key out of the leaf; a 2-node leaf becomes a hole */
+    tree_node_remove_key(leaf,i,i,treemap_pool(treemap)->wide);
+    for (i = 0;i < depth;++i)
+        --path[i]->size;
+    pool = treemap_pool(treemap);
+    while (--depth > 0 && path[depth]->keys[0] == NULL)
+        tree_node_do_fix(path[depth],path[depth-1],index[depth-1],treemap->cow,pool);
+    if (treemap->root->keys[0] == NULL) {
+        /* root node is a hole-node; delete the root node and assign its sole
+           child as the new root */
+        node = treemap->root;
+        treemap->root = node->children[0];
+        tree_node_free(pool,node);
+    }
+    /* delete the key: call its destructor if it was specified */
+    if (treemap->dstor != NULL) {
+        if (treemap->cow != NULL)
+            treemap_retire(treemap,removed);
+        else
+            (*treemap->dstor)(removed);
+    }
+    --treemap->count;
+    ++treemap->stamp;
+    return 0;
+}
+static void treemap_retire_keys(struct treemap* treemap,struct tree_node* node)
+{
+    int i;
+    for (i = 0;i < 3 && node->keys[i] != NULL;++i)
+        treemap_retire(treemap,node->keys[i]);
+    for (i = 0;i < 4 && node->children[i] != NULL;++i)
+        treemap_retire_keys(treemap,node->children[i]);
+}
+static void treemap_drop(struct treemap* treemap,struct tree_node* node,int destroy)
+{
+    /* release the nodes of a subtree that was cut out of the tree, destroying its
+       keys if 'destroy' (as treemap_remove would) */
+    if (node == NULL)
+        return;
+    if (treemap->cow != NULL) {
+        if (destroy && treemap->dstor != NULL)
+            treemap_retire_keys(treemap,node);
+        tree_node_release(node,treemap->cow,&treemap->ownpool);
+    }
+    else
+        tree_node_delete(node,destroy ? treemap->dstor : NULL,treemap_pool(treemap));
+}
+static void treemap_split_info(struct treemap* treemap,struct key_info* info)
+{
+    info->compar = treemap->compar;
+    info->dstor = treemap->dstor;
+    info->pool = treemap_pool(treemap);
+    info->track = NULL;
+    info->slot = NULL;
+}
+static void treemap_split_first(struct tree_node* node,int height,struct tree_split* split,struct treemap_cow* cow,struct key_info* info)
+{
+    /* split the least key off the (non-empty) tree rooted at 'node' */
+    struct tree_node* least = node;
+    while (least->children[0] != NULL)
+        least = least->children[0];
+    tree_node_split(node,height,least->keys[0],NULL,split,cow,info);
+}
+int treemap_split(struct treemap* treemap,const void* key,struct treemap* right)
+{
+    /* move the keys that are not less than 'key' into 'right' and return zero, or
+       return non-zero if 'right' is not empty (or either map is a snapshot); the
+       nodes move with the keys if both maps use the same shared pool, otherwise
+       the part that moves is copied into the pool of 'right' */
+    int n;
+    uint64_t nbuf;
+    struct key_info info;
+    struct tree_split split;
+    if (right == treemap || right->root != NULL || treemap->version >= 0 || right->version >= 0)
+        return 1;
+    if (treemap->root == NULL)
+        return 0;
+    if (treemap->cow != NULL)
+        treemap_collect(treemap);
+    treemap_split_info(treemap,&info);
+    tree_node_split(treemap->root,tree_node_height(treemap->root),key,treemap_norm(treemap,key,&nbuf),&split,treemap->cow,&info);
+    if (split.key != NULL)
+        split.right = tree_node_join(NULL,0,split.key,split.norm,split.right,split.hr,&split.hr,treemap->cow,&info);
+    treemap->root = split.left;
+    n = tree_node_size(split.right);
+    treemap->count -= n;
+    right->count = n;
+    ++treemap->stamp;
+    ++right->stamp;
+    right->root = split.right;
+    if (split.right != NULL && treemap_pool(right) != info.pool) {
+        right->root = tree_node_clone(split.right,right->normalizer,treemap_pool(right));
+        treemap_drop(treemap,split.right,0);
+    }
+    return 0;
+}
+int treemap_join(struct treemap* treemap,struct treemap* right)
+{
+    /* move every key of 'right' into 'treemap' and return zero, or return non-zero
+       if a key of 'right' is not greater than every key of 'treemap' (or either
+       map is a snapshot); the nodes move as they do for treemap_split */
+    int h;
+    struct key_info info;
+    struct tree_split split;
+    struct tree_node* node, *last;
+    if (right == treemap || treemap->version >= 0 || right->version >= 0)
+        return 1;
+    if (right->root == NULL)
+        return 0;
+    if (treemap->root != NULL) {
+        for (last = treemap->root;last->children[0] != NULL;last = last->children[tree_node_key_count(last)])
+            ;
+        for (node = right->root;node->children[0] != NULL;node = node->children[0])
+            ;
+        if ((*treemap->compar)(last->keys[tree_node_key_count(last)-1],node->keys[0]) >= 0)
+            return 1;
+    }
+    if (treemap->cow != NULL)
+        treemap_collect(treemap);
+    treemap_split_info(treemap,&info);
+    node = right->root;
+    if (treemap_pool(right) != info.pool) {
+        node = tree_node_clone(node,treemap->normalizer,info.pool);
+        /* the nodes of a persistent map may be shared with its snapshots */
+        if (right->cow != NULL)
+            treemap_drop(right,right->root,0);
+        else if (right->pool == NULL)
+            tree_node_pool_delete(&right->ownpool);
+        else
+            tree_node_delete(right->root,NULL,right->pool);
+    }
+    treemap->count += right->count;
+    right->root = NULL;
+    right->count = 0;
+    ++treemap->stamp;
+    ++right->stamp;
+    /* the least key of 'right' separates the two trees */
+    treemap_split_first(node,tree_node_height(node),&split,treemap->cow,&info);
+    h = tree_node_height(treemap->root);
+    treemap->root = tree_node_join(treemap->root,h,split.key,split.norm,split.right,split.hr,&h,treemap->cow,&info);
+    return 0;
+}
+int treemap_remove_range(struct treemap* treemap,const void* lo,const void* hi)
+{
+    /* remove the keys in [lo,hi) (a NULL bound is unbounded) and return how many
+       were removed; the tree is split at both bounds, the middle part is deleted
+       as a whole and the outer parts are joined again, so this costs O(log n)
+       plus the cost of destroying the removed keys */
+    int n, hl;
+    uint64_t nbuf;
+    void* first;
+    struct key_info info;
+    struct tree_split split;
+    struct tree_node* left, *mid;
+    if (treemap->root == NULL || (lo != NULL && hi != NULL && (*treemap->compar)(lo,hi) >= 0))
+        return 0;
+    if (treemap->cow != NULL)
+        treemap_collect(treemap);
+    treemap_split_info(treemap,&info);
+    left = NULL;
+    hl = 0;
+    first = NULL;
+    split.right = treemap->root;
+    split.hr = tree_node_height(treemap->root);
+    if (lo != NULL) {
+        tree_node_split(split.right,split.hr,lo,treemap_norm(treemap,lo,&nbuf),&split,treemap->cow,&info);
+        left = split.left;
+        hl = split.hl;
+        first = split.key; /* equal to 'lo' and so removed */
+    }
+    mid = split.right;
+    split.key = NULL;
+    split.right = NULL;
+    split.hr = 0;
+    if (hi != NULL)
+        tree_node_split(mid,tree_node_height(mid),hi,treemap_norm(treemap,hi,&nbuf),&split,treemap->cow,&info);
+    else
+        split.left = mid;
+    n = tree_node_size(split.left) + (first != NULL);
+    treemap_drop(treemap,split.left,1);
+    if (first != NULL && treemap->dstor != NULL) {
+        if (treemap->cow != NULL)
+            treemap_retire(treemap,first);
+        else
+            (*treemap->dstor)(first);
+    }
+    /* join the outer parts; the key equal to 'hi' (if any) or else the least key
+       after the range separates them */
+    if (split.key == NULL && split.right != NULL)
+        treemap_split_first(split.right,split.hr,&split,treemap->cow,&info);
+    if (split.key != NULL)
+        treemap->root = tree_node_join(left,hl,split.key,split.norm,split.right,split.hr,&hl,treemap->cow,&info);
+    else
+        treemap->root = left;
+    treemap->count -= n;
+    ++treemap->stamp;
+    return n;
+}
+static inline void treemap_cursor_push(struct treemap_cursor* cursor,struct tree_node* node,int index)
+{
+    cursor->nodes[cursor->depth] = node;
+    cursor->index[cursor->depth++] = index;
+}
+static void* treemap_cursor_descend(struct treemap_cursor* cursor,struct tree_node* node,int rightmost)
+{
+    /* push the path from 'node' down to its least (or greatest) key */
+    while (node->children[0] != NULL) {
+        int c = rightmost ? tree_node_key_count(node) : 0;
+        treemap_cursor_push(cursor,node,c);
+        node = node->children[c];
+    }
+    treemap_cursor_push(cursor,node,rightmost ? tree_node_key_count(node)-1 : 0);
+    return node->keys[cursor->index[cursor->depth-1]];
+}
+static void* treemap_cursor_ascend(struct treemap_cursor* cursor,int backward)
+{
+    /* the subtree at the top of the path is exhausted: pop up to the first
+       ancestor that has a key after (or before) the child that was taken */
+    while (--cursor->depth > 0) {
+        int i = cursor->depth - 1;
+        int c = cursor->index[i];
+        if (!backward && c < tree_node_key_count(cursor->nodes[i]))
+            return cursor->nodes[i]->keys[c];
+        if (backward && c > 0) {
+            cursor->index[i] = c - 1;
+            return cursor->nodes[i]->keys[c-1];
+        }
+    }
+    return NULL;
+}
+static void* treemap_cursor_seek(struct treemap_cursor* cursor,const void* key,int strict,int depth)
+{
+    /* position the cursor at the least key that is not less than 'key' (or, if
+       'strict', greater than 'key'); the first 'depth' levels of the cursor's path
+       are kept and the search starts at the node below them (at the root if
+       'depth' is zero), whose subtree must be where the key belongs */
+    struct tree_node* node;
+    uint64_t nbuf;
+    const uint64_t* norm;
+    key_comparator compar = cursor->treemap->compar;
+    cursor->depth = depth;
+    cursor->stamp = cursor->treemap->stamp;
+    norm = treemap_norm(cursor->treemap,key,&nbuf);
+    node = depth > 0 ? cursor->nodes[depth] : cursor->treemap->root;
+    while (node != NULL) {
+        int i, n;
+        n = tree_node_key_count(node);
+        for (i = 0;i < n;++i) {
+            int cmp = tree_node_compare(node,i,key,norm,compar);
+            if (cmp < 0 || (cmp == 0 && !strict))
+                break;
+        }
+        treemap_cursor_push(cursor,node,i);
+        if (i < n && (node->children[0] == NULL || (!strict && tree_node_compare(node,i,key,norm,compar) == 0)))
+            return node->keys[i];
+        node = node->children[i];
+    }
+    /* fell off a leaf past its last key */
+    return cursor->depth > 0 ? treemap_cursor_ascend(cursor,0) : NULL;
+}
+static int treemap_cursor_climb(struct treemap_cursor* cursor,const void* key,const uint64_t* norm)
+{
+    /* return the depth of the lowest node on the cursor's path whose subtree is
+       where 'key' belongs, or zero if the cursor is not positioned in the current
+       version of the tree; the path is climbed only until the separators on
+       both sides of it bound 'key'; the nodes have no links to their neighbors,
+       so a key just across a separator high in the tree still climbs that far
+       (O(log n) at worst), but keys that move through the tree in nearly sorted
+       order climb O(1) levels per call on average */
+    int i, c, lo, hi, start;
+    struct tree_node* parent;
+    struct treemap* treemap = cursor->treemap;
+    if (cursor->depth == 0 || cursor->stamp != treemap->stamp)
         return 0;
+    lo = hi = 0; /* whether 'key' is known to be above (below) the subtree's least (greatest) key */
+    start = cursor->depth - 1;
+    for (i = start;i > 0 && !(lo && hi);--i) {
+        parent = cursor->nodes[i-1];
+        c = cursor->index[i-1];
+        /* a separator that 'key' lies beyond excludes the subtree at 'i', and then
+           bounds 'key' on the other side for the parent's subtree */
+        if (!lo && c > 0) {
+            if (tree_node_compare(parent,c-1,key,norm,treemap->compar) > 0)
+                lo = 1;
+            else {
+                start = i - 1;
+                hi = 1;
+            }
+        }
+        if (!hi && c < tree_node_key_count(parent)) {
+            if (tree_node_compare(parent,c,key,norm,treemap->compar) < 0)
+                hi = 1;
+            else {
+                start = i - 1;
+                lo = 1;
+                hi = 0;
+            }
+        }
     }
-    return 1;
+    return start;
+}
+void treemap_cursor_init(struct treemap_cursor* cursor,struct treemap* treemap)
+{
+    cursor->treemap = treemap;
+    cursor->depth = 0;
+}
+void* treemap_cursor_key(struct treemap_cursor* cursor)
+{
+    /* return the key at the cursor or NULL if it is not positioned */
+    int i;
+    if (cursor->depth == 0)
+        return NULL;
+    i = cursor->depth - 1;
+    return cursor->nodes[i]->keys[cursor->index[i]];
+}
+void* treemap_cursor_first(struct treemap_cursor* cursor)
+{
+    cursor->depth = 0;
+    cursor->stamp = cursor->treemap->stamp;
+    if (cursor->treemap->root == NULL)
+        return NULL;
+    return treemap_cursor_descend(cursor,cursor->treemap->root,0);
+}
+void* treemap_cursor_last(struct treemap_cursor* cursor)
+{
+    cursor->depth = 0;
+    cursor->stamp = cursor->treemap->stamp;
+    if (cursor->treemap->root == NULL)
+        return NULL;
+    return treemap_cursor_descend(cursor,cursor->treemap->root,1);
+}
+void* treemap_cursor_select(struct treemap_cursor* cursor,int index)
+{
+    /* position the cursor at the key with 'index' keys before it; return NULL if
+       'index' is out of range */
+    int i, n;
+    struct tree_node* node;
+    cursor->depth = 0;
+    cursor->stamp = cursor->treemap->stamp;
+    if (index < 0 || index >= cursor->treemap->count)
+        return NULL;
+    node = cursor->treemap->root;
+    while (node != NULL) {
+        n = tree_node_key_count(node);
+        for (i = 0;i < n;++i) {
+            int left = tree_node_size(node->children[i]);
+            if (index < left)
+                break;
+            if (index == left) {
+                treemap_cursor_push(cursor,node,i);
+                return node->keys[i];
+            }
+            index -= left + 1;
+        }
+        treemap_cursor_push(cursor,node,i);
+        node = node->children[i];
+    }
+    cursor->depth = 0;
+    return NULL;
+}
+void* treemap_cursor_lower_bound(struct treemap_cursor* cursor,const void* key)
+{
+    /* position the cursor at the least key >= 'key'; return NULL if there is none */
+    return treemap_cursor_seek(cursor,key,0,0);
+}
+void* treemap_cursor_upper_bound(struct treemap_cursor* cursor,const void* key)
+{
+    /* position the cursor at the least key > 'key'; return NULL if there is none */
+    return treemap_cursor_seek(cursor,key,1,0);
+}
+void* treemap_cursor_next(struct treemap_cursor* cursor)
+{
+    /* advance to the next key and return it; return NULL (leaving the cursor
+       unpositioned) if the cursor was at the last key */
+    int i, k;
+    struct tree_node* node;
+    if (cursor->depth == 0)
+        return NULL;
+    i = cursor->depth - 1;
+    node = cursor->nodes[i];
+    k = cursor->index[i];
+    if (node->children[0] != NULL) {
+        /* the successor is the least key in the right subtree of this key */
+        cursor->index[i] = k + 1;
+        return treemap_cursor_descend(cursor,node->children[k+1],0);
+    }
+    if (k+1 < tree_node_key_count(node)) {
+        cursor->index[i] = k + 1;
+        return node->keys[k+1];
+    }
+    return treemap_cursor_ascend(cursor,0);
+}
+void* treemap_cursor_prev(struct treemap_cursor* cursor)
+{
+    /* step back to the previous key and return it; return NULL (leaving the cursor
+       unpositioned) if the cursor was at the first key */
+    int i, k;
+    struct tree_node* node;
+    if (cursor->depth == 0)
+        return NULL;
+    i = cursor->depth - 1;
+    node = cursor->nodes[i];
+    k = cursor->index[i];
+    if (node->children[0] != NULL)
+        /* the predecessor is the greatest key in the left subtree of this key */
+        return treemap_cursor_descend(cursor,node->children[k],1);
+    if (k > 0) {
+        cursor->index[i] = k - 1;
+        return node->keys[k-1];
+    }
+    return treemap_cursor_ascend(cursor,1);
+}
+int treemap_range(struct treemap* treemap,const void* lo,const void* hi,key_visitor visitor,void* data)
+{
+    /* visit the keys in [lo,hi) in order; a NULL bound is unbounded; stop early
+       if 'visitor' returns non-zero; return the number of keys visited */
+    int n;
+    void* key;
+    struct treemap_cursor cursor;
+    treemap_cursor_init(&cursor,treemap);
+    key = lo != NULL ? treemap_cursor_lower_bound(&cursor,lo) : treemap_cursor_first(&cursor);
+    n = 0;
+    while (key != NULL && (hi == NULL || (*treemap->compar)(key,hi) < 0)) {
+        ++n;
+        if ((*visitor)(key,data))
+            break;
+        key = treemap_cursor_next(&cursor);
+    }
+    return n;
+}
+int treemap_rank(struct treemap* treemap,const void* key)
+{
+    /* return the number of keys less than 'key' */
+    int i, n, rank;
+    struct tree_node* node;
+    uint64_t nbuf;
+    const uint64_t* norm;
+    rank = 0;
+    norm = treemap_norm(treemap,key,&nbuf);
+    node = treemap->root;
+    while (node != NULL) {
+        n = tree_node_key_count(node);
+        for (i = 0;i < n;++i) {
+            int cmp = tree_node_compare(node,i,key,norm,treemap->compar);
+            if (cmp < 0)
+                break;
+            rank += tree_node_size(node->children[i]);
+            if (cmp == 0)
+                return rank;
+            ++rank;
+        }
+        node = node->children[i];
+    }
+    return rank;
+}
+void* treemap_select(struct treemap* treemap,int index)
+{
+    /* return the key that has 'index' keys less than it (the key at position
+       'index' in order) or NULL if 'index' is out of range */
+    int i, n;
+    struct tree_node* node;
+    if (index < 0 || index >= treemap->count)
+        return NULL;
+    node = treemap->root;
+    while (node != NULL) {
+        n = tree_node_key_count(node);
+        for (i = 0;i < n;++i) {
+            int left = tree_node_size(node->children[i]);
+            if (index < left)
+                break;
+            if (index == left)
+                return node->keys[i];
+            index -= left + 1;
+        }
+        node = node->children[i];
+    }
+    return NULL;
+}
+int treemap_count_range(struct treemap* treemap,const void* lo,const void* hi)
+{
+    /* return the number of keys in [lo,hi); a NULL bound is unbounded */
+    int count;
+    count = hi != NULL ? treemap_rank(treemap,hi) : treemap->count;
+    if (lo != NULL)
+        count -= treemap_rank(treemap,lo);
+    return count > 0 ? count : 0;
+}
+static void treemap_merge_keys(struct treemap* a,struct treemap* b,int keep,void** out,int* n)
+{
+    /* merge the keys of 'a' and 'b' in order, keeping those that are only in 'a',
+       in both (the key from 'a' is kept) or only in 'b' as 'keep' says */
+    int cmp;
+    void* x, *y;
+    struct treemap_cursor ca, cb;
+    treemap_cursor_init(&ca,a);
+    treemap_cursor_init(&cb,b);
+    x = treemap_cursor_first(&ca);
+    y = treemap_cursor_first(&cb);
+    while (x != NULL || y != NULL) {
+        if (x == NULL)
+            cmp = 1;
+        else if (y == NULL)
+            cmp = -1;
+        else
+            cmp = (*a->compar)(x,y);
+        if (cmp < 0) {
+            if (keep & TREEMAP_MERGE_LEFT)
+                out[(*n)++] = x;
+            x = treemap_cursor_next(&ca);
+        }
+        else if (cmp > 0) {
+            if (keep & TREEMAP_MERGE_RIGHT)
+                out[(*n)++] = y;
+            y = treemap_cursor_next(&cb);
+        }
+        else {
+            if (keep & TREEMAP_MERGE_BOTH)
+                out[(*n)++] = x;
+            x = treemap_cursor_next(&ca);
+            y = treemap_cursor_next(&cb);
+        }
+    }
+}
+static void treemap_probe_keys(struct treemap* a,struct treemap* b,int present,int theirs,void** out,int* n)
+{
+    /* keep the keys of 'a' (in order) that are ('present') or are not in 'b'; if
+       'theirs' then the equal key found in 'b' is kept instead of the key of 'a' */
+    void* x, *y;
+    struct treemap_cursor ca;
+    treemap_cursor_init(&ca,a);
+    for (x = treemap_cursor_first(&ca);x != NULL;x = treemap_cursor_next(&ca))
+        if (((y = treemap_lookup(b,x)) != NULL) == present)
+            out[(*n)++] = theirs ? y : x;
+}
+static struct treemap* treemap_combine(struct treemap* a,struct treemap* b,int keep)
+{
+    /* build a new map from the keys of 'a' and 'b' that 'keep' selects; when one
+       map is much smaller than the other and the result can only hold keys of the
+       smaller map, its keys are looked up in the larger map instead of merging */
+    int n, size;
+    void** keys;
+    struct treemap* result;
+    result = treemap_new(a->compar,NULL);
+    if (result == NULL)
+        return NULL;
+    if (a->normalizer != NULL)
+        treemap_set_normalizer(result,a->normalizer);
+    size = (keep & TREEMAP_MERGE_LEFT ? a->count : 0) + (keep & TREEMAP_MERGE_RIGHT ? b->count : 0);
+    if (keep == TREEMAP_MERGE_BOTH)
+        size = a->count < b->count ? a->count : b->count;
+    if (size == 0)
+        return result;
+    keys = malloc(sizeof(void*) * size);
+    n = 0;
+    if (keep == TREEMAP_MERGE_BOTH && (int64_t)a->count * TREEMAP_MERGE_RATIO < b->count)
+        treemap_probe_keys(a,b,1,0,keys,&n);
+    else if (keep == TREEMAP_MERGE_BOTH && (int64_t)b->count * TREEMAP_MERGE_RATIO < a->count)
+        /* the keys in the result come from 'a', so keep the ones found there */
+        treemap_probe_keys(b,a,1,1,keys,&n);
+    else if (keep == TREEMAP_MERGE_LEFT && (int64_t)a->count * TREEMAP_MERGE_RATIO < b->count)
+        treemap_probe_keys(a,b,0,0,keys,&n);
+    else
+        treemap_merge_keys(a,b,keep,keys,&n);
+    treemap_build(result,keys,n);
+    free(keys);
+    return result;
+}
+struct treemap* treemap_union(struct treemap* a,struct treemap* b)
+{
+    /* return a new map with the keys in either 'a' or 'b' */
+    return treemap_combine(a,b,TREEMAP_MERGE_LEFT | TREEMAP_MERGE_BOTH | TREEMAP_MERGE_RIGHT);
+}
+struct treemap* treemap_intersect(struct treemap* a,struct treemap* b)
+{
+    /* return a new map with the keys in both 'a' and 'b' */
+    return treemap_combine(a,b,TREEMAP_MERGE_BOTH);
+}
+struct treemap* treemap_difference(struct treemap* a,struct treemap* b)
+{
+    /* return a new map with the keys in 'a' that are not in 'b' */
+    return treemap_combine(a,b,TREEMAP_MERGE_LEFT);
 }
 static void treemap_traversal_inorder_recursive(struct tree_node* node,key_callback callback)
 {
@@ -724,3 +2074,103 @@ int treemap_filter_count(struct treemap* treemap,key_filter_callback callback)
         treemap_filter_count_recursive(treemap->root,&num,callback);
     return num;
 }
+
+/* parallel traversal: the keys are divided by position into 'nthreads' runs of
+   (nearly) equal length; each run is found with a select descent and then
+   walked with a cursor, so every partition sees its keys in order; the calling
+   thread takes the first partition and a thread is started for each other one */
+struct treemap_partition
+{
+    pthread_t thread;
+    struct treemap* treemap;
+    int begin, end;
+    key_callback_ex callback;
+    key_filter_callback filter;
+    void* data;
+    int num;
+};
+static void* treemap_partition_run(void* arg)
+{
+    int i;
+    void* key;
+    struct treemap_cursor cursor;
+    struct treemap_partition* part = arg;
+    treemap_cursor_init(&cursor,part->treemap);
+    key = treemap_cursor_select(&cursor,part->begin);
+    for (i = part->begin;i < part->end;++i) {
+        if (part->callback != NULL)
+            (*part->callback)(key,part->data);
+        else if ( (*part->filter)(key) )
+            ++part->num;
+        key = treemap_cursor_next(&cursor);
+    }
+    return NULL;
+}
+static void treemap_partition_all(struct treemap* treemap,struct treemap_partition* parts,int nthreads)
+{
+    int i;
+    int64_t count = treemap->count;
+    for (i = 0;i < nthreads;++i) {
+        parts[i].treemap = treemap;
+        parts[i].begin = (int)(count * i / nthreads);
+        parts[i].end = (int)(count * (i+1) / nthreads);
+        parts[i].num = 0;
+    }
+    /* a partition whose thread cannot be started is run here instead */
+    for (i = 1;i < nthreads;++i)
+        if (pthread_create(&parts[i].thread,NULL,treemap_partition_run,parts+i) != 0)
+            parts[i].end = -1;
+    treemap_partition_run(parts);
+    for (i = 1;i < nthreads;++i) {
+        if (parts[i].end < 0) {
+            parts[i].end = (int)(count * (i+1) / nthreads);
+            treemap_partition_run(parts+i);
+        }
+        else
+            pthread_join(parts[i].thread,NULL);
+    }
+}
+void treemap_traversal_parallel(struct treemap* treemap,int nthreads,key_callback_ex callback,void** data,key_reducer reduce)
+{
+    /* visit every key using 'nthreads' threads; the keys of partition 'i' (which
+       are delivered to 'callback' in order) get 'data[i]' as their callback data;
+       the partitions cover consecutive ranges of keys, so if 'reduce' is not NULL
+       then 'data[i]' for i = 1, 2, ... is combined into 'data[0]' in key order
+       once all threads have finished; the callback must be safe to call from
+       several threads at once for different 'data' */
+    int i;
+    struct treemap_partition* parts;
+    if (nthreads < 1)
+        nthreads = 1;
+    parts = malloc(sizeof(struct treemap_partition) * nthreads);
+    for (i = 0;i < nthreads;++i) {
+        parts[i].callback = callback;
+        parts[i].filter = NULL;
+        parts[i].data = data[i];
+    }
+    treemap_partition_all(treemap,parts,nthreads);
+    free(parts);
+    if (reduce != NULL)
+        for (i = 1;i < nthreads;++i)
+            (*reduce)(data[0],data[i]);
+}
+int treemap_filter_count_parallel(struct treemap* treemap,int nthreads,key_filter_callback callback)
+{
+    /* like treemap_filter_count but uses 'nthreads' threads */
+    int i, num;
+    struct treemap_partition* parts;
+    if (nthreads < 1)
+        nthreads = 1;
+    parts = malloc(sizeof(struct treemap_partition) * nthreads);
+    for (i = 0;i < nthreads;++i) {
+        parts[i].callback = NULL;
+        parts[i].filter = callback;
+        parts[i].data = NULL;
+    }
+    treemap_partition_all(treemap,parts,nthreads);
+    num = 0;
+    for (i = 0;i < nthreads;++i)
+        num += parts[i].num;
+    free(parts);
+    return num;
+}
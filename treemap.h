@@ -2,6 +2,7 @@
 #ifndef DSTRUCTS_TREEMAP_H
 #define DSTRUCTS_TREEMAP_H
 #include "dstructs.h"
+#include <stdint.h>
 
 /* provide basic key types that a user may use to implement a map */
 struct tree_string_key
@@ -13,30 +14,150 @@ void tree_string_key_init(struct tree_string_key* key,const char* keyval,void* p
 void tree_string_key_delete(struct tree_string_key* key);
 int tree_string_key_compare(const struct tree_string_key* left,const struct tree_string_key* right);
 int tree_string_key_compare_insensitive(const struct tree_string_key* left,const struct tree_string_key* right);
+uint64_t tree_string_key_normalize(const struct tree_string_key* key);
+
+/* a 'key_normalizer' maps a key to an integer that preserves the order of the
+   keys: if one key compares less than another then its integer must not be
+   greater (so equal keys map to the same integer); the first eight bytes of a
+   string make a typical normalizer */
+typedef uint64_t (*key_normalizer)(const void* key);
 
 struct tree_node;
+struct tree_node_slab;
+struct treemap_cow;
+
+/* represents a pool of tree nodes; a map allocates its nodes from slabs owned by
+   a pool so that they sit close together and are released in a few large frees;
+   by default each map has a private pool but a pool may also be shared between
+   several maps (which must then not be used from different threads at the same
+   time); a shared pool must outlive the maps that use it */
+struct tree_node_pool
+{
+    struct tree_node_slab* slabs;
+    struct tree_node* free;
+    int wide; /* nodes have room for normalized key prefixes */
+};
+struct tree_node_pool* tree_node_pool_new();
+void tree_node_pool_free(struct tree_node_pool* pool);
+void tree_node_pool_init(struct tree_node_pool* pool);
+void tree_node_pool_delete(struct tree_node_pool* pool);
+
+/* the height of a 2-3 tree with at most INT_MAX keys never exceeds this */
+#define TREEMAP_MAX_HEIGHT 32
 
 /* represents a balanced tree structure for storing key objects by reference; a
    comparator must be used to compare two key object references; a destructor can
-   be provided (set to NULL if not used) to delete the object before it is freed */
+   be provided (set to NULL if not used) to delete the object before it is freed;
+   if a normalizer is set then the nodes keep each key's normalized prefix next
+   to it and a search compares those, calling the comparator only when they are
+   equal; a normalizer is set while the map is empty and needs nodes twice the
+   usual size, so a shared pool must not have allocated nodes yet */
 struct treemap
 {
     int count;
     struct tree_node* root;
     key_comparator compar;
     destructor dstor;
+    struct tree_node_pool* pool; /* shared pool or NULL if 'ownpool' is used */
+    struct tree_node_pool ownpool;
+    struct treemap_cow* cow; /* version state shared by a persistent map and its snapshots */
+    long version; /* snapshot version or -1 if the map is not a snapshot */
+    key_normalizer normalizer;
+    unsigned long stamp; /* changed by every modification that moves nodes */
 };
 struct treemap* treemap_new(key_comparator compar,destructor dstor);
+struct treemap* treemap_new_pool(key_comparator compar,destructor dstor,struct tree_node_pool* pool);
 struct treemap* treemap_new_ex(key_comparator compar,destructor dstor,void** keys,int size);
 void treemap_free(struct treemap* treemap);
 void treemap_init(struct treemap* treemap,key_comparator compar,destructor dstor);
+void treemap_init_pool(struct treemap* treemap,key_comparator compar,destructor dstor,struct tree_node_pool* pool);
 void treemap_init_ex(struct treemap* treemap,key_comparator compar,destructor dstor,void** keys,int size);
 void treemap_delete(struct treemap* treemap);
+int treemap_set_normalizer(struct treemap* treemap,key_normalizer normalizer);
 int treemap_insert(struct treemap* treemap,void* key);
+void** treemap_find_or_insert(struct treemap* treemap,void* key,int* inserted);
+int treemap_insert_sorted(struct treemap* treemap,void** keys,int size);
 void* treemap_lookup(struct treemap* treemap,const void* key);
+void* treemap_replace(struct treemap* treemap,void* key);
 int treemap_remove(struct treemap* treemap,const void* key);
 int treemap_filter_count(struct treemap* treemap,key_filter_callback callback);
+int treemap_rank(struct treemap* treemap,const void* key);
+void* treemap_select(struct treemap* treemap,int index);
+int treemap_count_range(struct treemap* treemap,const void* lo,const void* hi);
 void treemap_traversal_inorder(struct treemap* treemap,key_callback callback);
 void treemap_traversal_inorder_ex(struct treemap* treemap,key_callback_ex callback,void* data);
+int treemap_range(struct treemap* treemap,const void* lo,const void* hi,key_visitor visitor,void* data);
+void treemap_traversal_parallel(struct treemap* treemap,int nthreads,key_callback_ex callback,void** data,key_reducer reduce);
+int treemap_filter_count_parallel(struct treemap* treemap,int nthreads,key_filter_callback callback);
+
+/* set operations return a new map built in linear time from the keys of two maps
+   that use the same comparator; the new map refers to the same key objects (taking
+   those of 'a' where both maps hold equal keys) and has no destructor, so it must
+   be freed before they are destroyed; it uses the comparator and normalizer of 'a' */
+struct treemap* treemap_union(struct treemap* a,struct treemap* b);
+struct treemap* treemap_intersect(struct treemap* a,struct treemap* b);
+struct treemap* treemap_difference(struct treemap* a,struct treemap* b);
+
+/* treemap_split moves the keys not less than 'key' into the empty map 'right' and
+   treemap_join moves every key of 'right' into 'treemap' when they are all greater
+   than its keys; both take O(log n) when the maps share a pool (otherwise the
+   nodes that move are copied); the maps must use the same comparator and
+   normalizer and either may be persistent but not a snapshot, and keys moved
+   out of a persistent map may still be held by its snapshots;
+   treemap_remove_range removes the keys in [lo,hi) (a NULL bound is unbounded)
+   by splitting the tree around them, in O(log n) plus the cost of destroying
+   them, and returns how many were removed */
+int treemap_split(struct treemap* treemap,const void* key,struct treemap* right);
+int treemap_join(struct treemap* treemap,struct treemap* right);
+int treemap_remove_range(struct treemap* treemap,const void* lo,const void* hi);
+
+/* a persistent map copies the nodes along the path that a modification changes
+   whenever they are shared with a snapshot, so that treemap_snapshot can return
+   an immutable version of the map in constant time; snapshots are taken by the
+   single writer but may then be read from any thread without locking (using
+   any function that does not modify the map, including cursors, which stay
+   valid); a snapshot is released with treemap_free, from any thread, and all
+   snapshots must be released before the map itself is deleted; a removed key is
+   destroyed only when no snapshot that could hold it remains, but the key that
+   treemap_replace returns may still be held by snapshots; nodes come from the
+   map's private pool */
+struct treemap* treemap_new_persistent(key_comparator compar,destructor dstor);
+void treemap_init_persistent(struct treemap* treemap,key_comparator compar,destructor dstor);
+struct treemap* treemap_snapshot(struct treemap* treemap);
+
+/* represents a position within a treemap; the cursor remembers the path from the
+   root to its current key so that stepping to the next or previous key costs
+   amortized constant time; a cursor is invalidated by any modification of the
+   tree (other than treemap_replace on a map that is not persistent) and must
+   then be positioned again */
+struct treemap_cursor
+{
+    struct treemap* treemap;
+    unsigned long stamp; /* the map's stamp when the cursor was positioned */
+    int depth; /* zero if the cursor is not positioned at a key */
+    struct tree_node* nodes[TREEMAP_MAX_HEIGHT];
+    int index[TREEMAP_MAX_HEIGHT]; /* child index in each ancestor; key index in the last node */
+};
+void treemap_cursor_init(struct treemap_cursor* cursor,struct treemap* treemap);
+void* treemap_cursor_key(struct treemap_cursor* cursor);
+void* treemap_cursor_first(struct treemap_cursor* cursor);
+void* treemap_cursor_last(struct treemap_cursor* cursor);
+void* treemap_cursor_select(struct treemap_cursor* cursor,int index);
+void* treemap_cursor_lower_bound(struct treemap_cursor* cursor,const void* key);
+void* treemap_cursor_upper_bound(struct treemap_cursor* cursor,const void* key);
+void* treemap_cursor_next(struct treemap_cursor* cursor);
+void* treemap_cursor_prev(struct treemap_cursor* cursor);
+
+/* hinted operations use a cursor as a finger: the search climbs the cursor's
+   path from the root only as far as needed to reach the subtree where 'key'
+   belongs and descends from there; a run of keys in nearly sorted order thus
+   costs amortized O(log d) per key for steps of distance 'd' (in order) instead
+   of O(log n), but a single step is O(log n) in the worst case since even a
+   neighboring key may lie across a separator near the root; the cursor is left
+   at the key (or, for a lookup of a missing key, at the next key) for the next
+   call; a cursor that is not positioned, or was positioned before the map was
+   last modified by another call, costs a search from the root */
+int treemap_insert_hint(struct treemap* treemap,void* key,struct treemap_cursor* finger);
+void* treemap_lookup_hint(struct treemap* treemap,const void* key,struct treemap_cursor* finger);
 
 #endif
@@ -0,0 +1,413 @@
+/* treemap_type.h - generates an ordered map specialized for a key type; unlike
+   the other headers this one is included once for each map type, after
+   defining:
+
+     TREEMAP_TYPE_NAME       name of the map type; the generated structure is
+                             'struct NAME' and its functions are 'NAME_insert'
+                             and so on
+     TREEMAP_TYPE_KEY        key type (such as 'int' or 'uint64_t')
+     TREEMAP_TYPE_VALUE      value type
+     TREEMAP_TYPE_COMPARE    (optional) 'TREEMAP_TYPE_COMPARE(a,b)' returns a
+                             negative, zero or positive int as key 'a' is less
+                             than, equal to or greater than key 'b'; by default
+                             the keys are compared with '<' and '>'
+     TREEMAP_TYPE_ORDER      (optional) minimum degree of the B-tree; a node
+                             holds up to 2*ORDER-1 keys (default 16)
+
+   for example:
+
+     #define TREEMAP_TYPE_NAME intmap
+     #define TREEMAP_TYPE_KEY int
+     #define TREEMAP_TYPE_VALUE void*
+     #include "treemap_type.h"
+
+   the map is a B-tree (like btreemap) that stores keys and values inline in
+   its nodes and compares keys with inline code instead of calling a
+   key_comparator through void pointers; the parameters are undefined again at
+   the end of this header */
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef TREEMAP_TYPE_NAME
+#error "TREEMAP_TYPE_NAME must be defined before including treemap_type.h"
+#endif
+#ifndef TREEMAP_TYPE_KEY
+#error "TREEMAP_TYPE_KEY must be defined before including treemap_type.h"
+#endif
+#ifndef TREEMAP_TYPE_VALUE
+#error "TREEMAP_TYPE_VALUE must be defined before including treemap_type.h"
+#endif
+#ifndef TREEMAP_TYPE_COMPARE
+#define TREEMAP_TYPE_COMPARE(a,b) (((a) > (b)) - ((a) < (b)))
+#endif
+#ifndef TREEMAP_TYPE_ORDER
+#define TREEMAP_TYPE_ORDER 16
+#endif
+
+#ifndef DSTRUCTS_TREEMAP_TYPE_H
+#define DSTRUCTS_TREEMAP_TYPE_H
+#define TREEMAP_TYPE_CAT2(a,b) a##_##b
+#define TREEMAP_TYPE_CAT(a,b) TREEMAP_TYPE_CAT2(a,b)
+#define TREEMAP_TYPE_NODE_ALIGN 64
+#define TREEMAP_TYPE_REMOVE_KEY 0
+#define TREEMAP_TYPE_REMOVE_MIN 1
+#define TREEMAP_TYPE_REMOVE_MAX 2
+#endif
+
+/* shorthands used by the generated code */
+#define TT_(x) TREEMAP_TYPE_CAT(TREEMAP_TYPE_NAME,x)
+#define TT_KEY TREEMAP_TYPE_KEY
+#define TT_VALUE TREEMAP_TYPE_VALUE
+#define TT_NODE struct TT_(node)
+#define TT_MAX_KEYS (2*TREEMAP_TYPE_ORDER - 1)
+#define TT_MIN_KEYS (TREEMAP_TYPE_ORDER - 1)
+
+struct TT_(node)
+{
+    int count;
+    int leaf;
+    TT_KEY keys[TT_MAX_KEYS];
+    TT_VALUE values[TT_MAX_KEYS];
+    TT_NODE* children[]; /* only allocated for internal nodes */
+};
+struct TREEMAP_TYPE_NAME
+{
+    int count;
+    TT_NODE* root;
+};
+
+static inline TT_NODE* TT_(node_new)(int leaf)
+{
+    /* return a new empty node or NULL if it could not be allocated */
+    size_t size;
+    TT_NODE* node;
+    size = sizeof(TT_NODE);
+    if (!leaf)
+        size += sizeof(TT_NODE*) * (TT_MAX_KEYS+1);
+    size = (size + TREEMAP_TYPE_NODE_ALIGN-1) & ~(size_t)(TREEMAP_TYPE_NODE_ALIGN-1);
+    node = aligned_alloc(TREEMAP_TYPE_NODE_ALIGN,size);
+    if (node == NULL)
+        return NULL;
+    node->count = 0;
+    node->leaf = leaf;
+    return node;
+}
+static inline void TT_(node_delete)(TT_NODE* node)
+{
+    int i;
+    if (!node->leaf)
+        for (i = 0;i <= node->count;++i)
+            TT_(node_delete)(node->children[i]);
+    free(node);
+}
+static inline int TT_(node_search)(TT_NODE* node,TT_KEY key,int* found)
+{
+    /* return the index of the first key not less than 'key' and set '*found' if
+       it is equal to 'key' */
+    int lo, hi;
+    lo = 0;
+    hi = node->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (TREEMAP_TYPE_COMPARE(node->keys[mid],key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *found = lo < node->count && TREEMAP_TYPE_COMPARE(node->keys[lo],key) == 0;
+    return lo;
+}
+static inline void TT_(node_move)(TT_NODE* dst,int i,TT_NODE* src,int j,int n)
+{
+    /* move 'n' keys and values from 'j' in 'src' to 'i' in 'dst' */
+    memmove(dst->keys+i,src->keys+j,sizeof(TT_KEY) * n);
+    memmove(dst->values+i,src->values+j,sizeof(TT_VALUE) * n);
+}
+static inline int TT_(node_split_child)(TT_NODE* parent,int i)
+{
+    /* 'parent->children[i]' is full; move its upper half into a new right
+       sibling and its median key up into 'parent' (which is not full); return
+       non-zero (leaving the nodes unchanged) if the sibling could not be
+       allocated */
+    TT_NODE* left, *right;
+    left = parent->children[i];
+    right = TT_(node_new)(left->leaf);
+    if (right == NULL)
+        return 1;
+    right->count = TT_MIN_KEYS;
+    TT_(node_move)(right,0,left,TREEMAP_TYPE_ORDER,TT_MIN_KEYS);
+    if (!left->leaf)
+        memcpy(right->children,left->children+TREEMAP_TYPE_ORDER,sizeof(TT_NODE*) * TREEMAP_TYPE_ORDER);
+    left->count = TT_MIN_KEYS;
+    memmove(parent->children+i+2,parent->children+i+1,sizeof(TT_NODE*) * (parent->count-i));
+    TT_(node_move)(parent,i+1,parent,i,parent->count-i);
+    parent->children[i+1] = right;
+    TT_(node_move)(parent,i,left,TT_MIN_KEYS,1);
+    ++parent->count;
+    return 0;
+}
+static inline void TT_(node_merge_children)(TT_NODE* parent,int i)
+{
+    /* merge 'parent->children[i+1]' and the separator at 'i' into 'parent->children[i]';
+       both children hold the minimum number of keys */
+    TT_NODE* left, *right;
+    left = parent->children[i];
+    right = parent->children[i+1];
+    TT_(node_move)(left,left->count,parent,i,1);
+    TT_(node_move)(left,left->count+1,right,0,right->count);
+    if (!left->leaf)
+        memcpy(left->children+left->count+1,right->children,sizeof(TT_NODE*) * (right->count+1));
+    left->count += right->count + 1;
+    TT_(node_move)(parent,i,parent,i+1,parent->count-i-1);
+    memmove(parent->children+i+1,parent->children+i+2,sizeof(TT_NODE*) * (parent->count-i-1));
+    --parent->count;
+    free(right);
+}
+static inline int TT_(node_fill_child)(TT_NODE* parent,int i)
+{
+    /* make sure 'parent->children[i]' holds more than the minimum number of keys
+       before the removal descends into it (see btreemap.c); return the index of
+       the child to descend into */
+    TT_NODE* child, *sib;
+    child = parent->children[i];
+    if (child->count > TT_MIN_KEYS)
+        return i;
+    if (i > 0 && (sib = parent->children[i-1])->count > TT_MIN_KEYS) {
+        /* rotate the left sibling's last key through the parent */
+        TT_(node_move)(child,1,child,0,child->count);
+        if (!child->leaf) {
+            memmove(child->children+1,child->children,sizeof(TT_NODE*) * (child->count+1));
+            child->children[0] = sib->children[sib->count];
+        }
+        TT_(node_move)(child,0,parent,i-1,1);
+        TT_(node_move)(parent,i-1,sib,sib->count-1,1);
+        ++child->count;
+        --sib->count;
+        return i;
+    }
+    if (i < parent->count && (sib = parent->children[i+1])->count > TT_MIN_KEYS) {
+        /* rotate the right sibling's first key through the parent */
+        TT_(node_move)(child,child->count,parent,i,1);
+        TT_(node_move)(parent,i,sib,0,1);
+        TT_(node_move)(sib,0,sib,1,sib->count-1);
+        if (!child->leaf) {
+            child->children[child->count+1] = sib->children[0];
+            memmove(sib->children,sib->children+1,sizeof(TT_NODE*) * sib->count);
+        }
+        ++child->count;
+        --sib->count;
+        return i;
+    }
+    if (i < parent->count) {
+        TT_(node_merge_children)(parent,i);
+        return i;
+    }
+    TT_(node_merge_children)(parent,i-1);
+    return i-1;
+}
+static inline int TT_(node_remove)(TT_NODE* node,TT_KEY key,int mode,TT_KEY* outkey,TT_VALUE* outvalue)
+{
+    /* remove a key from the subtree rooted at 'node', storing it and its value in
+       '*outkey' and '*outvalue', and return non-zero (or zero if it was not found);
+       depending on 'mode' this is the key equal to 'key' or the subtree's least or
+       greatest key; 'node' must hold more than the minimum number of keys unless
+       it is the root */
+    while (1) {
+        int i, found;
+        if (mode == TREEMAP_TYPE_REMOVE_KEY)
+            i = TT_(node_search)(node,key,&found);
+        else {
+            i = mode == TREEMAP_TYPE_REMOVE_MIN ? 0 : node->count - node->leaf;
+            found = node->leaf;
+        }
+        if (node->leaf) {
+            if (!found)
+                return 0;
+            *outkey = node->keys[i];
+            *outvalue = node->values[i];
+            TT_(node_move)(node,i,node,i+1,node->count-i-1);
+            --node->count;
+            return 1;
+        }
+        if (found) {
+            /* replace the key with its predecessor or successor if a child can
+               spare one; otherwise merge the children around it */
+            *outkey = node->keys[i];
+            *outvalue = node->values[i];
+            if (node->children[i]->count > TT_MIN_KEYS)
+                return TT_(node_remove)(node->children[i],key,TREEMAP_TYPE_REMOVE_MAX,node->keys+i,node->values+i);
+            if (node->children[i+1]->count > TT_MIN_KEYS)
+                return TT_(node_remove)(node->children[i+1],key,TREEMAP_TYPE_REMOVE_MIN,node->keys+i,node->values+i);
+            TT_(node_merge_children)(node,i);
+            node = node->children[i];
+            continue;
+        }
+        node = node->children[TT_(node_fill_child)(node,i)];
+    }
+}
+static inline void TT_(node_traversal)(TT_NODE* node,void (*callback)(TT_KEY,TT_VALUE*,void*),void* data)
+{
+    int i;
+    for (i = 0;i < node->count;++i) {
+        if (!node->leaf)
+            TT_(node_traversal)(node->children[i],callback,data);
+        (*callback)(node->keys[i],node->values+i,data);
+    }
+    if (!node->leaf)
+        TT_(node_traversal)(node->children[i],callback,data);
+}
+
+static inline void TT_(init)(struct TREEMAP_TYPE_NAME* map)
+{
+    map->count = 0;
+    map->root = NULL;
+}
+static inline void TT_(delete)(struct TREEMAP_TYPE_NAME* map)
+{
+    if (map->root != NULL)
+        TT_(node_delete)(map->root);
+    map->root = NULL;
+    map->count = 0;
+}
+static inline struct TREEMAP_TYPE_NAME* TT_(new)()
+{
+    struct TREEMAP_TYPE_NAME* map;
+    map = malloc(sizeof(struct TREEMAP_TYPE_NAME));
+    if (map == NULL)
+        return NULL;
+    TT_(init)(map);
+    return map;
+}
+static inline void TT_(free)(struct TREEMAP_TYPE_NAME* map)
+{
+    if (map != NULL) {
+        TT_(delete)(map);
+        free(map);
+    }
+}
+static inline TT_VALUE* TT_(lookup)(struct TREEMAP_TYPE_NAME* map,TT_KEY key)
+{
+    /* return the value stored with 'key' or NULL if 'key' is not present */
+    int i, found;
+    TT_NODE* node;
+    node = map->root;
+    while (node != NULL) {
+        i = TT_(node_search)(node,key,&found);
+        if (found)
+            return node->values + i;
+        if (node->leaf)
+            break;
+        node = node->children[i];
+    }
+    return NULL;
+}
+static inline TT_VALUE* TT_(find_or_insert)(struct TREEMAP_TYPE_NAME* map,TT_KEY key,int* inserted)
+{
+    /* return the value stored with 'key'; if there was none then 'key' is
+       inserted (with an unset value that the caller should assign) and
+       '*inserted' is set; NULL is returned if 'key' is missing and a node could
+       not be allocated; the pointer is only valid until the map is next
+       modified */
+    int i, found;
+    TT_NODE* node;
+    *inserted = 0;
+    if (map->root == NULL) {
+        map->root = TT_(node_new)(1);
+        if (map->root == NULL)
+            return NULL;
+    }
+    else if (map->root->count == TT_MAX_KEYS) {
+        /* split a full root so the descent always has room to push a key up */
+        node = TT_(node_new)(0);
+        if (node == NULL)
+            return TT_(lookup)(map,key);
+        node->children[0] = map->root;
+        if (TT_(node_split_child)(node,0) != 0) {
+            free(node);
+            return TT_(lookup)(map,key);
+        }
+        map->root = node;
+    }
+    node = map->root;
+    while (1) {
+        i = TT_(node_search)(node,key,&found);
+        if (found)
+            return node->values + i;
+        if (node->leaf)
+            break;
+        if (node->children[i]->count == TT_MAX_KEYS) {
+            int cmp;
+            /* the tree is still valid if the split fails, and 'key' may already
+               be present below */
+            if (TT_(node_split_child)(node,i) != 0)
+                return TT_(lookup)(map,key);
+            cmp = TREEMAP_TYPE_COMPARE(key,node->keys[i]);
+            if (cmp == 0)
+                return node->values + i;
+            if (cmp > 0)
+                ++i;
+        }
+        node = node->children[i];
+    }
+    TT_(node_move)(node,i+1,node,i,node->count-i);
+    node->keys[i] = key;
+    ++node->count;
+    ++map->count;
+    *inserted = 1;
+    return node->values + i;
+}
+static inline int TT_(insert)(struct TREEMAP_TYPE_NAME* map,TT_KEY key,TT_VALUE value)
+{
+    /* insert 'key' with 'value' and return zero, or return non-zero (leaving the
+       map's keys unchanged) if 'key' is already present or a node could not be
+       allocated */
+    int inserted;
+    TT_VALUE* slot;
+    slot = TT_(find_or_insert)(map,key,&inserted);
+    if (!inserted)
+        return 1;
+    *slot = value;
+    return 0;
+}
+static inline int TT_(remove)(struct TREEMAP_TYPE_NAME* map,TT_KEY key,TT_VALUE* value)
+{
+    /* remove 'key' and store its value in '*value' (if 'value' is not NULL);
+       return non-zero if 'key' was not present */
+    int found;
+    TT_KEY oldkey;
+    TT_VALUE oldvalue;
+    TT_NODE* root;
+    root = map->root;
+    if (root == NULL)
+        return 1;
+    found = TT_(node_remove)(root,key,TREEMAP_TYPE_REMOVE_KEY,&oldkey,&oldvalue);
+    /* the root loses its last key when its only two children merge */
+    if (root->count == 0) {
+        map->root = root->leaf ? NULL : root->children[0];
+        free(root);
+    }
+    if (!found)
+        return 1;
+    if (value != NULL)
+        *value = oldvalue;
+    --map->count;
+    return 0;
+}
+static inline void TT_(traversal_inorder)(struct TREEMAP_TYPE_NAME* map,void (*callback)(TT_KEY,TT_VALUE*,void*),void* data)
+{
+    /* call 'callback' with each key, a pointer to its value and 'data' in order */
+    if (map->root != NULL)
+        TT_(node_traversal)(map->root,callback,data);
+}
+
+#undef TT_
+#undef TT_KEY
+#undef TT_VALUE
+#undef TT_NODE
+#undef TT_MAX_KEYS
+#undef TT_MIN_KEYS
+#undef TREEMAP_TYPE_NAME
+#undef TREEMAP_TYPE_KEY
+#undef TREEMAP_TYPE_VALUE
+#undef TREEMAP_TYPE_COMPARE
+#undef TREEMAP_TYPE_ORDER